@@ -0,0 +1,93 @@
+//
+// Per-algorithm calibration of the node's thread count and batch size.
+//
+#include "AutoTune.h"
+#include "Log.h"
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <utility>
+
+AutoTune::AutoTune(string cache_path, string machine_key)
+        : cache_path(std::move(cache_path)), machine_key(std::move(machine_key)) {
+    load();
+}
+
+string AutoTune::algorithm_of(const string &salt) {
+    string prefix = salt;
+    if (!prefix.empty() && prefix.back() == '$') prefix.pop_back();
+    size_t last = prefix.rfind('$');
+    return last == string::npos ? prefix : prefix.substr(0, last + 1);
+}
+
+optional<AutoTune::Config> AutoTune::cached(const string &algo) const {
+    auto it = cache.find(machine_key + " " + algo);
+    if (it == cache.end()) return nullopt;
+    return it->second;
+}
+
+void AutoTune::begin(const string &algo, vector<int> threads, vector<long long> batches) {
+    algorithm = algo;
+    thread_counts = std::move(threads);
+    batch_sizes = std::move(batches);
+    step = 0;
+    sweeping_batches = false;
+    best_rate = -1;
+    best_config = {thread_counts.empty() ? 1 : thread_counts.back(), batch_sizes.empty() ? 64 : batch_sizes.front()};
+    active = !thread_counts.empty();
+}
+
+AutoTune::Config AutoTune::current() const {
+    if (!sweeping_batches) return {thread_counts[step], batch_sizes.front()};
+    return {best_config.threads, batch_sizes[step]};
+}
+
+bool AutoTune::record(double hashes_per_second) {
+    if (!active) return false;
+    if (hashes_per_second > best_rate) {
+        best_rate = hashes_per_second;
+        best_config = current();
+    }
+
+    ++step;
+    if (!sweeping_batches && step >= thread_counts.size()) {
+        // The default batch size was measured during the thread sweep; try the others.
+        sweeping_batches = true;
+        step = 1;
+    }
+    if (sweeping_batches && step >= batch_sizes.size()) {
+        active = false;
+        cache[machine_key + " " + algorithm] = best_config;
+        save();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Cache lines are "<machine_key> <algorithm> <threads> <batch_size>".
+ * The machine key has no spaces and neither do crypt prefixes.
+ */
+void AutoTune::load() {
+    ifstream in(cache_path);
+    string line;
+    while (getline(in, line)) {
+        istringstream fields(line);
+        string machine, algo;
+        Config config{};
+        if (fields >> machine >> algo >> config.threads >> config.batch_size && config.threads > 0
+            && config.batch_size > 0)
+            cache[machine + " " + algo] = config;
+    }
+}
+
+void AutoTune::save() const {
+    ofstream out(cache_path, ios::trunc);
+    if (!out) {
+        LOG(WARN) << "Could not write tuning cache: " << cache_path;
+        return;
+    }
+    for (const auto &[key, config] : cache) {
+        out << key << " " << config.threads << " " << config.batch_size << "\n";
+    }
+}
@@ -0,0 +1,74 @@
+//
+// Per-algorithm calibration of the node's thread count and batch size.
+//
+
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <unordered_map>
+
+using namespace std;
+
+/**
+ * Sweeps thread counts at the default batch size, then batch sizes at the best
+ * thread count, keeping the configuration with the highest measured hash rate.
+ * Results are cached on disk per algorithm and machine, so the sweep only runs
+ * the first time a node sees an algorithm.
+ */
+class AutoTune {
+public:
+    struct Config {
+        int threads;
+        long long batch_size;
+    };
+
+    AutoTune(string cache_path, string machine_key);
+
+    /**
+     * Algorithm and cost parameters of a crypt salt with the random part removed,
+     * e.g. "$y$j9T$" or "$2b$12$".
+     */
+    static string algorithm_of(const string &salt);
+
+    [[nodiscard]] optional<Config> cached(const string &algorithm) const;
+
+    /**
+     * Starts a sweep for an algorithm.
+     * @param thread_counts Thread counts to try, already capped by CPUs and cgroup quota.
+     * @param batch_sizes Batch sizes to try at the best thread count; the first is the default.
+     */
+    void begin(const string &algorithm, vector<int> thread_counts, vector<long long> batch_sizes);
+
+    [[nodiscard]] bool running() const { return active; }
+    [[nodiscard]] Config current() const;
+    [[nodiscard]] Config best() const { return best_config; }
+
+    /**
+     * Records the hash rate measured for current(). Moves to the next configuration,
+     * or finishes and saves the best one to the cache.
+     * @return true while the sweep is still running.
+     */
+    bool record(double hashes_per_second);
+
+private:
+    string cache_path;
+    string machine_key;
+    unordered_map<string, Config> cache; // Keyed by "machine_key algorithm".
+
+    bool active = false;
+    string algorithm;
+    vector<int> thread_counts;
+    vector<long long> batch_sizes;
+    size_t step = 0;                      // Index into thread_counts, then into batch_sizes.
+    bool sweeping_batches = false;
+    Config best_config{1, 64};
+    double best_rate = -1;
+
+    void load();
+    void save() const;
+};
+
+#endif //AUTOTUNE_H
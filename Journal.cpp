@@ -0,0 +1,143 @@
+//
+// Append-only journal of the controller's work ledger, for resuming after a crash.
+//
+#include "Journal.h"
+#include "Log.h"
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include <utility>
+
+Journal::Journal(string path, string job)
+        : path(path), snapshot_path(path + ".snapshot"), job(std::move(job)),
+          last_sync(chrono::steady_clock::now()), last_compaction(last_sync) {}
+
+Journal::~Journal() {
+    flush(true);
+    if (fd >= 0) close(fd);
+}
+
+/**
+ * Applies "F <frontier>", "A <start> <end>" and "D <start> <end>" lines to the ledger.
+ * A torn last line from a crash fails to parse and is skipped.
+ */
+bool Journal::replay(const string &file, const string &job, WorkLedger &ledger, size_t *count) {
+    ifstream in(file);
+    if (!in) return true;
+    string line;
+    if (getline(in, line) && line != "J " + job) {
+        LOG(WARN) << "[journal] " << file << " belongs to another job: " << line;
+        return false;
+    }
+    while (getline(in, line)) {
+        istringstream fields(line);
+        char kind;
+        long long start, end = 0;
+        if (!(fields >> kind >> start)) continue;
+        if (kind == 'F') {
+            ledger.extend(start - 1);
+        } else if (fields >> end) {
+            if (kind == 'A') ledger.extend(end);
+            else if (kind == 'D') ledger.complete(start, end);
+        }
+        if (count) ++*count;
+    }
+    return true;
+}
+
+bool Journal::recover(WorkLedger &ledger) {
+    if (!replay(snapshot_path, job, ledger, nullptr)) return false;
+    if (!replay(path, job, ledger, &records)) return false;
+    return open_journal(false);
+}
+
+bool Journal::open_journal(bool truncate) {
+    if (fd >= 0) close(fd);
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+    if (fd < 0) {
+        LOG(ERROR) << "[journal] open failed: " << strerror(errno);
+        return false;
+    }
+    if (lseek(fd, 0, SEEK_END) == 0) {
+        pending.insert(0, "J " + job + "\n");
+    }
+    return true;
+}
+
+void Journal::append(char kind, long long start, long long end) {
+    pending.push_back(kind);
+    pending.append(" ").append(to_string(start)).append(" ").append(to_string(end)).append("\n");
+    ++records;
+}
+
+void Journal::assigned(long long start, long long end) {
+    append('A', start, end);
+}
+
+void Journal::completed(long long start, long long end) {
+    append('D', start, end);
+}
+
+void Journal::flush(bool force) {
+    auto now = chrono::steady_clock::now();
+    if (fd < 0 || pending.empty() || (!force && now - last_sync < sync_interval)) return;
+    size_t written = 0;
+    while (written < pending.size()) {
+        ssize_t n = write(fd, pending.data() + written, pending.size() - written);
+        if (n <= 0) {
+            LOG(ERROR) << "[journal] write failed: " << strerror(errno);
+            break;
+        }
+        written += n;
+    }
+    pending.erase(0, written);
+    fdatasync(fd);
+    last_sync = now;
+}
+
+bool Journal::compaction_due() const {
+    return records >= compaction_records ||
+           (records > 0 && chrono::steady_clock::now() - last_compaction >= compaction_interval);
+}
+
+void Journal::compact(const WorkLedger &ledger) {
+    string tmp_path = snapshot_path + ".tmp";
+    {
+        ofstream out(tmp_path, ios::trunc);
+        out << "J " << job << "\n" << "F " << ledger.frontier() << "\n";
+        for (const auto &[start, end] : ledger.ranges(WorkLedger::DONE)) {
+            out << "D " << start << " " << end << "\n";
+        }
+        if (!out) {
+            LOG(WARN) << "[journal] Failed to write snapshot " << tmp_path;
+            return;
+        }
+    }
+    int tmp_fd = open(tmp_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (tmp_fd >= 0) {
+        fsync(tmp_fd);
+        close(tmp_fd);
+    }
+    if (rename(tmp_path.c_str(), snapshot_path.c_str()) != 0) {
+        LOG(ERROR) << "[journal] rename failed: " << strerror(errno);
+        return;
+    }
+    // Make the rename itself durable before dropping the journal it replaces.
+    size_t slash = snapshot_path.rfind('/');
+    string dir = slash == string::npos ? "." : snapshot_path.substr(0, slash + 1);
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    // Anything buffered is already reflected in the ledger, hence in the snapshot.
+    pending.clear();
+    records = 0;
+    last_compaction = chrono::steady_clock::now();
+    open_journal(true);
+    flush(true);
+}
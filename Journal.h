@@ -0,0 +1,72 @@
+//
+// Append-only journal of the controller's work ledger, for resuming after a crash.
+//
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <chrono>
+#include <string>
+#include "WorkLedger.h"
+
+using namespace std;
+
+/**
+ * Records every range handed out and every range reported searched as a text line,
+ * written in batches and synced with fdatasync at most every sync_interval.
+ * Periodically the whole ledger is written to a snapshot and the journal truncated.
+ *
+ * Losing the unsynced tail in a crash only costs recomputation: a lost assignment
+ * lets the range be handed out again, and a lost completion gets searched again.
+ *
+ * Files: <path> holds the journal, <path>.snapshot the last compacted ledger.
+ * Both start with a "J <job>" line so a journal is never applied to a different job.
+ */
+class Journal {
+public:
+    Journal(string path, string job);
+    ~Journal();
+
+    /**
+     * Rebuilds the ledger from the snapshot and journal, if any. Ranges that were
+     * leased when the controller died come back as free.
+     * @return false if the files belong to a different job or can't be opened.
+     */
+    bool recover(WorkLedger &ledger);
+
+    void assigned(long long start, long long end);
+    void completed(long long start, long long end);
+
+    /**
+     * Writes and syncs buffered records if the sync interval has passed, or now when forced.
+     */
+    void flush(bool force = false);
+
+    [[nodiscard]] bool compaction_due() const;
+
+    /**
+     * Writes the ledger to a new snapshot, atomically replaces the old one and
+     * starts an empty journal.
+     */
+    void compact(const WorkLedger &ledger);
+
+private:
+    string path;
+    string snapshot_path;
+    string job;
+    int fd = -1;
+    string pending;                            // Records not yet written.
+    chrono::steady_clock::time_point last_sync;
+    chrono::steady_clock::time_point last_compaction;
+    size_t records = 0;                        // Records since the last snapshot.
+
+    static constexpr chrono::milliseconds sync_interval{200};
+    static constexpr chrono::seconds compaction_interval{60};
+    static constexpr size_t compaction_records = 100000;
+
+    bool open_journal(bool truncate);
+    void append(char kind, long long start, long long end);
+    static bool replay(const string &file, const string &job, WorkLedger &ledger, size_t *count);
+};
+
+#endif //JOURNAL_H
@@ -0,0 +1,227 @@
+//
+// Asynchronous logger: threads format a line into a lock-free ring, a background thread writes it.
+//
+#include "Log.h"
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <fcntl.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t RING_SIZE = 4096; // Power of two.
+constexpr auto IDLE_WAIT = chrono::milliseconds(10);
+const char *const LEVEL_NAMES[] = {"debug", "info", "warn", "error", "off"};
+
+/**
+ * A ring cell. `sequence` says whose turn it is: equal to the position when free for
+ * the producer claiming it, position + 1 once the line is in and the writer may take it.
+ */
+struct Slot {
+    atomic<size_t> sequence;
+    Log::Level level;
+    unsigned thread;
+    long long time_ns;
+    size_t length;
+    char text[Log::MAX_LINE];
+};
+
+Slot ring[RING_SIZE];
+atomic<size_t> enqueue_pos{0};
+size_t dequeue_pos = 0;                // Writer thread only.
+atomic<unsigned long long> dropped_lines{0};
+atomic<bool> running{false};
+atomic<bool> stopping{false};
+thread writer;
+Log::Format format = Log::TEXT;
+int out_fd = STDOUT_FILENO, err_fd = STDERR_FILENO;
+atomic<unsigned> next_thread{0};
+thread_local unsigned thread_number = next_thread++;
+
+void write_all(int fd, const string &data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n <= 0) return;
+        written += n;
+    }
+}
+
+/**
+ * Appends one line in the configured format to `out`.
+ */
+void format_line(string &out, Log::Level level, unsigned thread, long long time_ns, string_view message) {
+    if (format == Log::TEXT) {
+        out.append(message);
+        out.push_back('\n');
+        return;
+    }
+    time_t seconds = time_ns / 1'000'000'000;
+    tm utc{};
+    gmtime_r(&seconds, &utc);
+    char stamp[64];
+    size_t n = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(stamp + n, sizeof(stamp) - n, ".%03lldZ", (time_ns / 1'000'000) % 1000);
+    out.append("{\"ts\":\"").append(stamp).append("\",\"level\":\"").append(LEVEL_NAMES[level])
+            .append("\",\"thread\":").append(to_string(thread)).append(",\"msg\":\"");
+    for (char c : message) {
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out.append(escaped);
+        } else {
+            out.push_back(c);
+        }
+    }
+    out.append("\"}\n");
+}
+
+long long now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Moves everything in the ring to the output in one write per stream.
+ * @return Whether there was anything.
+ */
+bool drain() {
+    string out, err;
+    while (true) {
+        Slot &slot = ring[dequeue_pos & (RING_SIZE - 1)];
+        if (slot.sequence.load(memory_order_acquire) != dequeue_pos + 1) break;
+        string &target = (format == Log::TEXT && slot.level >= Log::WARN) ? err : out;
+        format_line(target, slot.level, slot.thread, slot.time_ns, string_view(slot.text, slot.length));
+        slot.sequence.store(dequeue_pos + RING_SIZE, memory_order_release);
+        ++dequeue_pos;
+    }
+    if (!out.empty()) write_all(out_fd, out);
+    if (!err.empty()) write_all(err_fd, err);
+    return !out.empty() || !err.empty();
+}
+
+void writer_loop() {
+    unsigned long long reported = 0;
+    while (true) {
+        bool finishing = stopping.load();
+        bool wrote = drain();
+        unsigned long long lost = dropped_lines.load(memory_order_relaxed);
+        if (lost != reported) {
+            string line;
+            string message = to_string(lost - reported) + " log lines dropped, the ring was full";
+            format_line(line, Log::WARN, thread_number, now_ns(), message);
+            write_all(format == Log::TEXT ? err_fd : out_fd, line);
+            reported = lost;
+        }
+        if (finishing) return;
+        if (!wrote) this_thread::sleep_for(IDLE_WAIT);
+    }
+}
+
+} // namespace
+
+atomic<Log::Level> Log::threshold{Log::INFO};
+
+bool Log::start(Level level, Format output, const string &path) {
+    if (running) return true;
+    set_threshold(level);
+    format = output;
+    if (!path.empty()) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        out_fd = err_fd = fd;
+    }
+    for (size_t i = 0; i < RING_SIZE; ++i) ring[i].sequence.store(i, memory_order_relaxed);
+    enqueue_pos = 0;
+    dequeue_pos = 0;
+    stopping = false;
+    writer = thread(writer_loop);
+    running = true;
+    static bool registered = false;
+    if (!registered) {
+        atexit(stop);
+        registered = true;
+    }
+    return true;
+}
+
+void Log::stop() {
+    if (!running.exchange(false)) return;
+    stopping = true;
+    writer.join();
+    drain(); // Lines pushed while the writer was finishing.
+}
+
+bool Log::configure(const string &level, const string &output, const string &path) {
+    Level threshold_level = INFO;
+    Format output_format = TEXT;
+    if (!level.empty() && !parse_level(level, threshold_level)) {
+        write_all(STDERR_FILENO, "Unknown log level: " + level + "\n");
+        return false;
+    }
+    if (!output.empty() && !parse_format(output, output_format)) {
+        write_all(STDERR_FILENO, "Unknown log format: " + output + "\n");
+        return false;
+    }
+    if (!start(threshold_level, output_format, path)) {
+        write_all(STDERR_FILENO, "Cannot open log file: " + path + "\n");
+        return false;
+    }
+    return true;
+}
+
+bool Log::parse_level(const string &name, Level &level) {
+    for (int i = DEBUG; i <= OFF; ++i) {
+        if (name == LEVEL_NAMES[i]) {
+            level = static_cast<Level>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Log::parse_format(const string &name, Format &output) {
+    if (name == "text") output = TEXT;
+    else if (name == "json") output = JSON;
+    else return false;
+    return true;
+}
+
+unsigned long long Log::dropped() {
+    return dropped_lines.load(memory_order_relaxed);
+}
+
+void Log::submit(Level level, string_view message) {
+    if (!running.load(memory_order_acquire)) {
+        // No writer yet, or it has stopped: write straight through.
+        string line;
+        format_line(line, level, thread_number, now_ns(), message);
+        write_all((format == TEXT && level >= WARN) ? err_fd : out_fd, line);
+        return;
+    }
+    size_t pos = enqueue_pos.load(memory_order_relaxed);
+    Slot *slot;
+    while (true) {
+        slot = &ring[pos & (RING_SIZE - 1)];
+        size_t sequence = slot->sequence.load(memory_order_acquire);
+        auto diff = static_cast<long long>(sequence) - static_cast<long long>(pos);
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            dropped_lines.fetch_add(1, memory_order_relaxed);
+            return;
+        } else {
+            pos = enqueue_pos.load(memory_order_relaxed);
+        }
+    }
+    slot->level = level;
+    slot->thread = thread_number;
+    slot->time_ns = now_ns();
+    slot->length = message.size();
+    memcpy(slot->text, message.data(), message.size());
+    slot->sequence.store(pos + 1, memory_order_release);
+}
@@ -0,0 +1,122 @@
+//
+// Asynchronous logger: threads format a line into a lock-free ring, a background thread writes it.
+//
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <atomic>
+#include <charconv>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+using namespace std;
+
+/**
+ * Logging for the controller and node. A call site formats into a fixed buffer on its
+ * own stack and pushes it onto a bounded multi-producer ring without locking or
+ * allocating; the writer thread drains the ring in batches and writes each batch with
+ * one syscall, so an event loop never waits on the terminal. When the ring is full the
+ * line is dropped and counted rather than blocking the caller.
+ *
+ * Use through the LOG macro, which skips formatting entirely below the threshold:
+ *     LOG(DEBUG) << "Assigning " << start << "-" << end;
+ *
+ * TEXT writes the message alone, INFO and DEBUG to stdout and the rest to stderr, as the
+ * programs always printed. JSON writes one object per line with a timestamp, level,
+ * thread and the message, to stdout or the log file.
+ */
+class Log {
+public:
+    enum Level : unsigned char { DEBUG, INFO, WARN, ERROR, OFF };
+    enum Format : unsigned char { TEXT, JSON };
+
+    static constexpr size_t MAX_LINE = 480; // Longer messages are truncated.
+
+    /**
+     * Starts the writer thread. Lines logged before this are written synchronously.
+     * @param path File to append to; empty for stdout and stderr.
+     * @return false if the file can't be opened.
+     */
+    static bool start(Level threshold, Format format, const string &path = "");
+
+    /**
+     * Writes everything still in the ring and stops the writer. Also runs at exit.
+     */
+    static void stop();
+
+    static bool enabled(Level level) { return level >= threshold.load(memory_order_relaxed); }
+    static void set_threshold(Level level) { threshold.store(level, memory_order_relaxed); }
+
+    /**
+     * Starts the logger from --log-level (debug|info|warn|error|off, default info),
+     * --log-format (text|json, default text) and --log-file values; empty means default.
+     * @return false, after saying why on stderr, if a value is invalid.
+     */
+    static bool configure(const string &level, const string &format, const string &path);
+
+    static bool parse_level(const string &name, Level &level);
+    static bool parse_format(const string &name, Format &format);
+
+    /**
+     * Lines lost to a full ring so far.
+     */
+    static unsigned long long dropped();
+
+    /**
+     * One log line, pushed to the ring when it goes out of scope.
+     */
+    class Line {
+    public:
+        explicit Line(Level level) : level(level) {}
+        ~Line() { submit(level, string_view(text, length)); }
+        Line(const Line &) = delete;
+        Line &operator=(const Line &) = delete;
+
+        Line &operator<<(string_view value) {
+            size_t n = min(value.size(), MAX_LINE - length);
+            memcpy(text + length, value.data(), n);
+            length += n;
+            return *this;
+        }
+        Line &operator<<(const char *value) { return *this << string_view(value); }
+        Line &operator<<(const string &value) { return *this << string_view(value); }
+        Line &operator<<(char value) { return *this << string_view(&value, 1); }
+        Line &operator<<(bool value) { return *this << (value ? "true" : "false"); }
+
+        template<typename T, enable_if_t<is_arithmetic_v<T>, int> = 0>
+        Line &operator<<(T value) {
+            to_chars_result result;
+            if constexpr (is_floating_point_v<T>) {
+                result = to_chars(text + length, text + MAX_LINE, value, chars_format::general, 6); // As iostream prints.
+            } else {
+                result = to_chars(text + length, text + MAX_LINE, value);
+            }
+            if (result.ec == errc()) length = result.ptr - text;
+            return *this;
+        }
+
+    private:
+        Level level;
+        size_t length = 0;
+        char text[MAX_LINE];
+    };
+
+    /**
+     * Turns a finished Line into void, so LOG can be the branch of a conditional
+     * expression. `&` binds looser than `<<` and tighter than `?:`.
+     */
+    struct Voidify {
+        void operator&(Line &) {}
+    };
+
+private:
+    static atomic<Level> threshold;
+    static void submit(Level level, string_view message);
+};
+
+#define LOG(level) !Log::enabled(Log::level) ? (void) 0 : Log::Voidify() & Log::Line(Log::level)
+
+#endif //LOG_H
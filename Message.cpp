@@ -2,6 +2,9 @@
 // Created by waleed on 26/03/25.
 //
 #include "Message.h"
+#include <algorithm>
+#include <cstring>
+#include <numeric>
 
 /**
  * Default Constructor
@@ -41,141 +44,402 @@ Message::Message(Message::MessageType type, const Message::Found &Found_Data) {
     this->Found_Data = Found_Data;
 }
 
+Message::Message(Message::MessageType type, const Message::Hello &Hello_Data) {
+    this->type = type;
+    this->Hello_Data = Hello_Data;
+}
 
-// ASSIGN SERIALIZATION and DESERIALIZATION
+Message::Message(Message::MessageType type, const Message::Telemetry &Telemetry_Data) {
+    this->type = type;
+    this->Telemetry_Data = Telemetry_Data;
+}
 
-/**
- * Assign Data
- * @return String representation of the Assign struct.
- */
-string Message::Assign::serialize() const {
-    string result;
-    result.reserve(64 + hashed_password.size() + salt.size());
-    result.append(to_string(node_id)).append(",")
-          .append(to_string(checkpoint)).append(",")
-          .append(to_string(range.first)).append("-")
-          .append(to_string(range.second)).append(",")
-          .append(hashed_password).append(",")
-          .append(salt);
-    return result;
+Message::Message(Message::MessageType type, const Message::Job &Job_Data) {
+    this->type = type;
+    this->Job_Data = Job_Data;
+}
+
+
+// WIRE ENCODING
+//
+// Unsigned LEB128 varints: seven bits per byte, high bit set while more follow.
+// Signed values are zigzag mapped first so small negatives stay short.
+
+static void put_varint(string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+static void put_signed(string &out, long long value) {
+    put_varint(out, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+}
+
+static void put_string(string &out, string_view value) {
+    put_varint(out, value.size());
+    out.append(value);
+}
+
+static void put_double(string &out, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; ++i) out.push_back(static_cast<char>(bits >> (8 * i)));
+}
+
+static void put_range(string &out, const pair<long long, long long> &range) {
+    put_signed(out, range.first);
+    put_signed(out, range.second - range.first);
+}
+
+static uint64_t get_varint(string_view &in) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (in.empty()) throw runtime_error("truncated varint");
+        auto byte = static_cast<uint8_t>(in.front());
+        in.remove_prefix(1);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    throw runtime_error("varint too long");
+}
+
+static long long get_signed(string_view &in) {
+    uint64_t raw = get_varint(in);
+    return static_cast<long long>((raw >> 1) ^ -(raw & 1));
+}
+
+static string_view get_string(string_view &in) {
+    uint64_t size = get_varint(in);
+    if (size > in.size()) throw runtime_error("truncated string");
+    string_view value = in.substr(0, size);
+    in.remove_prefix(size);
+    return value;
+}
+
+static double get_double(string_view &in) {
+    if (in.size() < 8) throw runtime_error("truncated double");
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; ++i) bits |= static_cast<uint64_t>(static_cast<uint8_t>(in[i])) << (8 * i);
+    in.remove_prefix(8);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static pair<long long, long long> get_range(string_view &in) {
+    long long start = get_signed(in);
+    return {start, start + get_signed(in)};
 }
 
 /**
- *
- * @param data
- * @return
+ * Bounds a count read off the wire by the bytes left, so a corrupt frame can't
+ * make the reader reserve gigabytes.
  */
-Message::Assign Message::Assign::deserialize(const std::string &data) {
-    size_t pos1 = data.find(',');
-    size_t pos2 = data.find(',', pos1 + 1);
-    size_t pos3 = data.find(',', pos2 + 1);
-    size_t pos4 = data.find(',', pos3 + 1);
+static size_t get_count(string_view &in, size_t min_item_size) {
+    uint64_t count = get_varint(in);
+    if (count > in.size() / min_item_size) throw runtime_error("count exceeds frame");
+    return count;
+}
+
+// JOB SERIALIZATION AND DESERIALIZATION
+
+void Message::Job::serialize(string &out) const {
+    put_signed(out, job_id);
+    put_signed(out, checkpoint);
+    put_string(out, hashed_password);
+    put_string(out, salt);
+}
 
-    int node_id = stoi(data.substr(0, pos1));
-    long long checkpoint = stoll(data.substr(pos1 + 1, pos2 - pos1 - 1));
-    string range_str = data.substr(pos2 + 1, pos3 - pos2 - 1);
-    size_t dash = range_str.find('-');
-    long long start = stoll(range_str.substr(0, dash));
-    long long end = stoll(range_str.substr(dash + 1));
+Message::Job Message::Job::deserialize(string_view &data) {
+    Job job{};
+    job.job_id = static_cast<int>(get_signed(data));
+    job.checkpoint = get_signed(data);
+    job.hashed_password = string(get_string(data));
+    job.salt = string(get_string(data));
+    return job;
+}
 
-    string hashed_password = data.substr(pos3 + 1, pos4 - pos3 -1);
-    string  salt = data.substr(pos4 + 1);
+// ASSIGN SERIALIZATION and DESERIALIZATION
 
-    return {node_id, checkpoint, {start, end}, hashed_password, salt};
+void Message::Assign::serialize(string &out) const {
+    put_signed(out, node_id);
+    put_signed(out, job_id);
+    put_varint(out, ranges.size());
+    for (const auto &r : ranges) put_range(out, r);
+}
+
+Message::Assign Message::Assign::deserialize(string_view &data) {
+    int node_id = static_cast<int>(get_signed(data));
+    int job_id = static_cast<int>(get_signed(data));
+    vector<pair<long long, long long>> ranges(get_count(data, 2));
+    for (auto &r : ranges) r = get_range(data);
+    return {node_id, job_id, ranges};
 }
 
 // CHECKPOINT SERIALIZATION AND DESERIALIZATION
+//
+// Ranges are sorted and merged first, then written in whichever of three layouts is
+// smallest. With chunk = the gcd of every boundary's offset from the first start
+// (a node's batches line up on its batch size, so this is often 64 or more):
+//   DELTA   gap from the previous range and length, in candidates.
+//   RUNS    the same gaps and lengths, in chunks.
+//   BITMAP  one bit per chunk from the first start to the last end.
+
+enum CheckpointEncoding : uint8_t { DELTA, RUNS, BITMAP };
+
+static size_t varint_size(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
 
 /**
- *
- * @return
+ * Sorted, non-overlapping, non-adjacent copy of ranges.
  */
-string  Message::Checkpoint::serialize() const {
-    string result;
-    result.reserve(16 + ranges.size() * 24);
-    result.append(to_string(node_id));
+static vector<pair<long long, long long>> normalized(vector<pair<long long, long long>> ranges) {
+    sort(ranges.begin(), ranges.end());
+    vector<pair<long long, long long>> merged;
     for (const auto &r : ranges) {
-        result.append(":").append(to_string(r.first)).append("-").append(to_string(r.second));
+        if (!merged.empty() && merged.back().second + 1 >= r.first) {
+            merged.back().second = max(merged.back().second, r.second);
+        } else {
+            merged.push_back(r);
+        }
     }
-    return result;
+    return merged;
 }
 
-/**
- * Deserializer for the
- * @param data
- * @return
- */
-Message::Checkpoint Message::Checkpoint::deserialize(const std::string &data) {
-    size_t colon = data.find(':');
-    int node_id = stoi(data.substr(0, colon));
+void Message::Checkpoint::serialize(string &out) const {
+    put_signed(out, node_id);
+    auto merged = normalized(ranges);
+    if (merged.empty()) {
+        out.push_back(static_cast<char>(DELTA));
+        put_varint(out, 0);
+        return;
+    }
 
-    vector<pair<long long, long long>> ranges;
-    size_t start = colon + 1, end;
-
-    while ((end = data.find(':', start)) != string::npos) {
-        size_t dash = data.find('-', start);
-        long long r1 = stoll(data.substr(start, dash - start));
-        long long r2 = stoll(data.substr(dash + 1, end - dash - 1));
-        ranges.emplace_back(r1, r2);
-        start = end + 1;
+    const long long base = merged.front().first;
+    long long chunk = 0;
+    for (const auto &[start, end] : merged) chunk = gcd(chunk, gcd(start - base, end + 1 - base));
+    const long long span_chunks = (merged.back().second + 1 - base) / chunk;
+
+    size_t delta_size = varint_size(merged.size()), runs_size = varint_size(merged.size());
+    long long previous = 0;
+    for (const auto &[start, end] : merged) {
+        delta_size += varint_size(start - previous) + varint_size(end - start);
+        runs_size += varint_size((start - previous) / chunk) + varint_size((end + 1 - start) / chunk);
+        previous = end + 1;
+    }
+    runs_size += varint_size(base) + varint_size(chunk);
+    size_t bitmap_size = varint_size(base) + varint_size(chunk) + varint_size(span_chunks) + (span_chunks + 7) / 8;
+
+    if (bitmap_size < delta_size && bitmap_size < runs_size) {
+        out.push_back(static_cast<char>(BITMAP));
+        put_varint(out, base);
+        put_varint(out, chunk);
+        put_varint(out, span_chunks);
+        size_t bits = out.size();
+        out.append((span_chunks + 7) / 8, '\0');
+        for (const auto &[start, end] : merged) {
+            for (long long c = (start - base) / chunk; c < (end + 1 - base) / chunk; ++c)
+                out[bits + c / 8] = static_cast<char>(out[bits + c / 8] | (1 << (c % 8)));
+        }
+        return;
     }
 
-    if (start < data.length()) {
-        size_t dash = data.find('-', start);
-        long long r1 = stoll(data.substr(start, dash - start));
-        long long r2 = stoll(data.substr(dash + 1));
-        ranges.emplace_back(r1, r2);
+    bool runs = runs_size < delta_size;
+    long long unit = runs ? chunk : 1;
+    out.push_back(static_cast<char>(runs ? RUNS : DELTA));
+    if (runs) {
+        put_varint(out, base);
+        put_varint(out, chunk);
     }
+    put_varint(out, merged.size());
+    previous = runs ? base : 0;
+    for (const auto &[start, end] : merged) {
+        put_varint(out, (start - previous) / unit);
+        put_varint(out, runs ? (end + 1 - start) / unit : end - start);
+        previous = end + 1;
+    }
+}
 
+Message::Checkpoint Message::Checkpoint::deserialize(string_view &data) {
+    int node_id = static_cast<int>(get_signed(data));
+    if (data.empty()) throw runtime_error("truncated checkpoint");
+    auto encoding = static_cast<uint8_t>(data.front());
+    data.remove_prefix(1);
+
+    vector<pair<long long, long long>> ranges;
+    if (encoding == DELTA) {
+        ranges.resize(get_count(data, 2));
+        long long previous = 0;
+        for (auto &r : ranges) {
+            r.first = previous + static_cast<long long>(get_varint(data));
+            r.second = r.first + static_cast<long long>(get_varint(data));
+            previous = r.second + 1;
+        }
+    } else if (encoding == RUNS) {
+        auto base = static_cast<long long>(get_varint(data));
+        auto chunk = static_cast<long long>(get_varint(data));
+        if (chunk <= 0) throw runtime_error("bad checkpoint chunk size");
+        ranges.resize(get_count(data, 2));
+        long long previous = base;
+        for (auto &r : ranges) {
+            r.first = previous + static_cast<long long>(get_varint(data)) * chunk;
+            r.second = r.first + static_cast<long long>(get_varint(data)) * chunk - 1;
+            previous = r.second + 1;
+        }
+    } else if (encoding == BITMAP) {
+        auto base = static_cast<long long>(get_varint(data));
+        auto chunk = static_cast<long long>(get_varint(data));
+        if (chunk <= 0) throw runtime_error("bad checkpoint chunk size");
+        uint64_t span_chunks = get_varint(data);
+        if ((span_chunks + 7) / 8 > data.size()) throw runtime_error("truncated checkpoint bitmap");
+        for (uint64_t c = 0; c < span_chunks; ++c) {
+            if (!(static_cast<uint8_t>(data[c / 8]) & (1 << (c % 8)))) continue;
+            long long start = base + static_cast<long long>(c) * chunk;
+            if (!ranges.empty() && ranges.back().second + 1 == start) {
+                ranges.back().second += chunk;
+            } else {
+                ranges.emplace_back(start, start + chunk - 1);
+            }
+        }
+        data.remove_prefix((span_chunks + 7) / 8);
+    } else {
+        throw runtime_error("unknown checkpoint encoding " + to_string(encoding));
+    }
     return {node_id, ranges};
 }
 
 // FOUND SERIALIZATION AND DESERIALIZATION
 
-string Message::Found::serialize() const {
-    return to_string(node_id) + "," + to_string(pwd_idx);
+void Message::Found::serialize(string &out) const {
+    put_signed(out, node_id);
+    put_signed(out, pwd_idx);
+}
+
+Message::Found Message::Found::deserialize(string_view &data) {
+    int node_id = static_cast<int>(get_signed(data));
+    return {node_id, get_signed(data)};
+}
+
+// HELLO SERIALIZATION AND DESERIALIZATION
 
+void Message::Hello::serialize(string &out) const {
+    put_signed(out, node_id);
+    put_signed(out, threads);
+    put_varint(out, session);
+    put_varint(out, leases.size());
+    for (const auto &lease : leases) put_range(out, lease);
+    put_string(out, placement);
 }
 
-Message::Found Message::Found::deserialize(const string &data) {
-    size_t delim = data.find(',');
-    int node_id = stoi(data.substr(0, delim));
-    long long pwd_idx = stoll(data.substr(delim + 1));
-    return {node_id, pwd_idx};
+Message::Hello Message::Hello::deserialize(string_view &data) {
+    Hello hello{};
+    hello.node_id = static_cast<int>(get_signed(data));
+    hello.threads = static_cast<int>(get_signed(data));
+    hello.session = get_varint(data);
+    hello.leases.resize(get_count(data, 2));
+    for (auto &lease : hello.leases) lease = get_range(data);
+    hello.placement = string(get_string(data));
+    return hello;
+}
+
+// HEARTBEAT SERIALIZATION AND DESERIALIZATION
+
+void Message::Telemetry::serialize(string &out) const {
+    put_signed(out, node_id);
+    put_signed(out, tested);
+    put_signed(out, idle_ms);
+    put_signed(out, io_ms);
+    put_varint(out, thread_rates.size());
+    for (double rate : thread_rates) put_double(out, rate);
+}
+
+Message::Telemetry Message::Telemetry::deserialize(string_view &data) {
+    Telemetry telemetry{};
+    telemetry.node_id = static_cast<int>(get_signed(data));
+    telemetry.tested = get_signed(data);
+    telemetry.idle_ms = get_signed(data);
+    telemetry.io_ms = get_signed(data);
+    telemetry.thread_rates.resize(get_count(data, 8));
+    for (double &rate : telemetry.thread_rates) rate = get_double(data);
+    return telemetry;
 }
 
 /**
  * Serialization -> Calls the appropriate serialization based on the type.
- * @return serialized string
+ * @return serialized frame body
  */
 string Message::serialize() const {
-    string result = to_string(type);
+    string result;
+    result.reserve(32);
+    serialize_body(result);
+    return result;
+}
+
+void Message::append_frame(string &out) const {
+    size_t header = out.size();
+    out.append(4, '\0');
+    serialize_body(out);
+    auto size = static_cast<uint32_t>(out.size() - header - 4);
+    for (int i = 0; i < 4; ++i) out[header + i] = static_cast<char>(size >> (24 - 8 * i));
+}
+
+void Message::serialize_body(string &result) const {
+    result.push_back(static_cast<char>(PROTOCOL_VERSION));
+    result.push_back(static_cast<char>(type));
 
     if (Assign_Data) {
-        result.append("|").append(Assign_Data->serialize());
+        Assign_Data->serialize(result);
     } else if (Checkpoint_Data) {
-        result.append("|").append(Checkpoint_Data->serialize());
+        Checkpoint_Data->serialize(result);
     } else if (Found_Data) {
-        result.append("|").append(Found_Data->serialize());
+        Found_Data->serialize(result);
+    } else if (Hello_Data) {
+        Hello_Data->serialize(result);
+    } else if (Telemetry_Data) {
+        Telemetry_Data->serialize(result);
+    } else if (Job_Data) {
+        Job_Data->serialize(result);
     }
-    return result;
 }
 
 /**
  * Deserialization -> Calls the appropriate deserialization based on the type.
- * @param data The data to be deserialized
+ * @param data The frame body, viewed in place.
  * @return Message Object
  */
-Message Message::deserialize(const std::string &data) {
-    size_t delim = data.find('|');
-    MessageType type = static_cast<MessageType>(stoi(data.substr(0, delim)));
-    string content = (delim != string::npos) ? data.substr(delim + 1) : "";
+Message Message::deserialize(string_view data) {
+    if (data.size() < 2) throw runtime_error("frame too short");
+    if (static_cast<uint8_t>(data[0]) != PROTOCOL_VERSION)
+        throw runtime_error("unsupported protocol version " + to_string(static_cast<uint8_t>(data[0])));
+    auto type = static_cast<MessageType>(static_cast<uint8_t>(data[1]));
+    data.remove_prefix(2);
 
     switch (type) {
-        case ASSIGN: return Message{type, Assign::deserialize(content)};
-        case CHECKPOINT: return Message{type, Checkpoint::deserialize(content)};
-        case FOUND: return Message{type, Found::deserialize(content)};
-        default: return Message{type};
+        case ASSIGN: return Message{type, Assign::deserialize(data)};
+        case REQUEST:
+            // A REQUEST may piggyback the units the node completed since its last request.
+            if (data.empty()) return Message{type};
+            return Message{type, Checkpoint::deserialize(data)};
+        case CHECKPOINT:
+        case REVOKE:
+        case SHRINK:
+            return Message{type, Checkpoint::deserialize(data)};
+        case FOUND: return Message{type, Found::deserialize(data)};
+        case HELLO: return Message{type, Hello::deserialize(data)};
+        case HEARTBEAT: return Message{type, Telemetry::deserialize(data)};
+        case JOB: return Message{type, Job::deserialize(data)};
+        case STOP:
+        case CONTINUE:
+            return Message{type};
+        default: throw runtime_error("unknown message type " + to_string(static_cast<int>(type)));
     }
 }
 
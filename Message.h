@@ -10,45 +10,88 @@
 #include <vector>
 #include <stdexcept>
 #include <optional>
+#include <string_view>
+#include <cstdint>
 
 using namespace std;
 
+/**
+ * Version byte leading every frame. Bump it whenever the binary layout changes;
+ * a peer speaking another version is rejected rather than misparsed.
+ */
+constexpr uint8_t PROTOCOL_VERSION = 4;
+
 class Message {
 public:
     enum MessageType {
-        REQUEST,    // From node to controller to get work assigned.
-        ASSIGN,     // From controller to node to assign work range.
+        REQUEST,    // From node to controller to get work assigned. May carry the units completed so far.
+        ASSIGN,     // From controller to node to assign one or more work ranges.
         CHECKPOINT, // From node to controller upon reaching checkpoint_interval.
         FOUND,      // From node to controller upon finding password.
         STOP,       // From controller to node to stop nodes once password's been found
                     // upon receiving checkpoint_interval.
         CONTINUE,   // From controller to node upon receiving checkpoint_interval
                     // but password hasn't been found.
+        HELLO,      // From node to controller after connecting: thread count, CPU placement, session
+                    // token and leases it still holds. Echoed back with the session token to use.
+        HEARTBEAT,  // From node to controller periodically: hash rate, idle and I/O time.
+        JOB,        // From controller to node once per connection, before the first ASSIGN:
+                    // the job's hash, salt and checkpoint interval. ASSIGNs refer to it by id.
+        REVOKE,     // From controller to node: stop working on these ranges, another node finished them.
+        SHRINK,     // From controller to node: give up the tail of a lease so a new node can take it.
+                    // The node answers with a SHRINK listing the part it actually gave up.
     };
 
-    struct Assign {
-        int node_id;
+    struct Job {
+        int job_id;
         long long checkpoint;
-        pair <long long, long long> range;
         string hashed_password;
-        string  salt;
-        string serialize() const;
-        static Assign deserialize(const string &data);
+        string salt;
+        void serialize(string &out) const;
+        static Job deserialize(string_view &data);
+    };
+
+    struct Assign {
+        int node_id;
+        int job_id;                         // A Job the node was sent on this connection.
+        vector<pair <long long, long long>> ranges; // The node's lease window; worked in order.
+        void serialize(string &out) const;
+        static Assign deserialize(string_view &data);
     };
 
 
     struct Checkpoint {
         int node_id;
         vector<pair <long long, long long>> ranges;
-        string serialize() const;
-        static Checkpoint deserialize(const string &data);
+        void serialize(string &out) const;
+        static Checkpoint deserialize(string_view &data);
     };
 
     struct Found {
         int node_id;
         long long pwd_idx;
-        string  serialize() const;
-        static Found deserialize(const string &data);
+        void serialize(string &out) const;
+        static Found deserialize(string_view &data);
+    };
+
+    struct Hello {
+        int node_id;
+        int threads;
+        unsigned long long session;               // 0 on first connect, then the token the controller issued.
+        vector<pair<long long, long long>> leases; // Ranges the node still holds when reconnecting.
+        string placement; // Human readable pinning summary, may contain commas.
+        void serialize(string &out) const;
+        static Hello deserialize(string_view &data);
+    };
+
+    struct Telemetry {
+        int node_id;
+        long long tested;            // Candidates tested since the node started.
+        long long idle_ms;           // Summed over pool threads: time spent waiting for work.
+        long long io_ms;             // Time the I/O thread spent sending and receiving.
+        vector<double> thread_rates; // Hashes per second of each pool thread over the last interval.
+        void serialize(string &out) const;
+        static Telemetry deserialize(string_view &data);
     };
 
     /**
@@ -58,18 +101,39 @@ public:
 
     // Optional Properties for the Message Class to simplify communication.
     optional<Assign> Assign_Data; // Server -> Node : To assign data range to work on.
-    optional<Checkpoint> Checkpoint_Data; // Node -> Server : For Nodes to checkpoint_interval their progress.
+    optional<Checkpoint> Checkpoint_Data; // Node -> Server : For Nodes to checkpoint_interval their progress,
+                                          // or the units finished since the last REQUEST.
+                                          // Server -> Node : Ranges a REVOKE or SHRINK takes back.
     optional<Found> Found_Data;
+    optional<Hello> Hello_Data; // Node <-> Server : Session handshake after (re)connecting.
+    optional<Telemetry> Telemetry_Data; // Node -> Server : Heartbeat payload.
+    optional<Job> Job_Data; // Server -> Node : Job descriptor referenced by later ASSIGNs.
 
     explicit Message(MessageType type);
     Message();
     Message(MessageType type, const Assign &Assign_Data);
     Message(MessageType type, const Checkpoint &Checkpoint_Data);
     Message(MessageType type, const Found &Found_Data);
+    Message(MessageType type, const Hello &Hello_Data);
+    Message(MessageType type, const Telemetry &Telemetry_Data);
+    Message(MessageType type, const Job &Job_Data);
 
-    //TODO Implement the serialization with optionals in mind.
+    /**
+     * Binary frame body: version byte, type byte, then the payload with integers as
+     * varints. Parsing reads straight from the caller's buffer and throws on a
+     * truncated or foreign frame.
+     */
     [[nodiscard]] string serialize() const;
-    static Message deserialize(const string &data);
+    static Message deserialize(string_view data);
+
+    /**
+     * Appends the whole frame, 4-byte big-endian length then body, so a sender can
+     * queue several frames in one buffer and write them with a single syscall.
+     */
+    void append_frame(string &out) const;
+
+private:
+    void serialize_body(string &out) const;
 
 
 };
@@ -0,0 +1,114 @@
+//
+// Prometheus text exposition: lock-free histograms and a minimal HTTP endpoint.
+//
+#include "Metrics.h"
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+string number(double value) {
+    if (isinf(value)) return value > 0 ? "+Inf" : "-Inf";
+    if (isnan(value)) return "NaN";
+    char text[32];
+    auto result = to_chars(text, text + sizeof(text), value); // Shortest form that reads back the same.
+    return string(text, result.ptr);
+}
+
+string with_label(const string &labels, const string &extra) {
+    return labels.empty() ? extra : labels + "," + extra;
+}
+
+void send_all(int fd, const string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return;
+        sent += n;
+    }
+}
+
+/**
+ * Reads the request head and answers it. Only the request line matters.
+ */
+void answer(int fd, const function<string()> &render) {
+    timeval timeout{1, 0}; // A scraper that stalls either way doesn't hold up the next one, or shutdown, for long.
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    string request;
+    char chunk[1024];
+    while (request.find("\r\n\r\n") == string::npos && request.size() < 8192) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) break;
+        request.append(chunk, n);
+    }
+    string status = "200 OK", body;
+    if (request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET / ", 0) == 0) {
+        body = render();
+    } else {
+        status = "404 Not Found";
+        body = "Metrics are at /metrics\n";
+    }
+    send_all(fd, "HTTP/1.1 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                 + to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body);
+}
+
+} // namespace
+
+void Histogram::observe(chrono::nanoseconds elapsed) {
+    double seconds = chrono::duration<double>(elapsed).count();
+    size_t bucket = 0;
+    while (bucket < BUCKETS && seconds > BOUNDS[bucket]) ++bucket;
+    buckets[bucket].fetch_add(1, memory_order_relaxed);
+    total.fetch_add(1, memory_order_relaxed);
+    sum_ns.fetch_add(static_cast<uint64_t>(elapsed.count()), memory_order_relaxed);
+}
+
+void Histogram::write(string &out, const string &name, const string &labels) const {
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i <= BUCKETS; ++i) {
+        cumulative += buckets[i].load(memory_order_relaxed);
+        string le = i < BUCKETS ? number(BOUNDS[i]) : "+Inf";
+        Metrics::sample(out, name + "_bucket", with_label(labels, "le=\"" + le + "\""), static_cast<double>(cumulative));
+    }
+    Metrics::sample(out, name + "_sum", labels, static_cast<double>(sum_ns.load(memory_order_relaxed)) / 1e9);
+    Metrics::sample(out, name + "_count", labels, static_cast<double>(cumulative));
+}
+
+void Metrics::family(string &out, const string &name, const string &type, const string &help) {
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+void Metrics::sample(string &out, const string &name, const string &labels, double value) {
+    out.append(name);
+    if (!labels.empty()) out.append("{").append(labels).append("}");
+    out.append(" ").append(number(value)).append("\n");
+}
+
+void Metrics::single(string &out, const string &name, const string &type, const string &help, double value) {
+    family(out, name, type, help);
+    sample(out, name, "", value);
+}
+
+void Metrics::serve(int listen_fd, const function<string()> &render, const function<void()> &tick,
+                    const atomic<bool> &done) {
+    auto next_tick = chrono::steady_clock::now();
+    while (!done) {
+        auto now = chrono::steady_clock::now();
+        if (now >= next_tick) {
+            tick();
+            next_tick = now + chrono::seconds(1);
+        }
+        pollfd readable{listen_fd, POLLIN, 0};
+        if (poll(&readable, 1, 200) <= 0) continue;
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) continue;
+        answer(fd, render);
+        close(fd);
+    }
+}
@@ -0,0 +1,69 @@
+//
+// Prometheus text exposition: lock-free histograms and a minimal HTTP endpoint.
+//
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+using namespace std;
+
+/**
+ * Latency histogram with fixed buckets from 1µs to 1s. Any thread can observe into it;
+ * each observation is a few relaxed atomic increments, so it stays on under full load.
+ */
+class Histogram {
+public:
+    static constexpr double BOUNDS[] = {1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+                                        1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1.0};
+    static constexpr size_t BUCKETS = sizeof(BOUNDS) / sizeof(BOUNDS[0]);
+
+    void observe(chrono::nanoseconds elapsed);
+
+    /**
+     * Appends the _bucket, _sum and _count series. `labels` is empty or like `type="ASSIGN"`.
+     */
+    void write(string &out, const string &name, const string &labels) const;
+
+    [[nodiscard]] uint64_t count() const { return total.load(memory_order_relaxed); }
+
+private:
+    atomic<uint64_t> buckets[BUCKETS + 1]{}; // Not cumulative; the last one is +Inf.
+    atomic<uint64_t> total{0};
+    atomic<uint64_t> sum_ns{0};
+};
+
+/**
+ * Helpers that write one metric in the Prometheus text format, and the endpoint.
+ */
+class Metrics {
+public:
+    /**
+     * Writes the # HELP and # TYPE lines that start a metric family.
+     */
+    static void family(string &out, const string &name, const string &type, const string &help);
+
+    /**
+     * Writes one sample: `name{labels} value`.
+     */
+    static void sample(string &out, const string &name, const string &labels, double value);
+
+    /**
+     * A whole single-sample family.
+     */
+    static void single(string &out, const string &name, const string &type, const string &help, double value);
+
+    /**
+     * Serves GET /metrics on a listening socket until `done`, one scrape at a time, with
+     * the body from `render`. Calls `tick` about once a second between scrapes.
+     */
+    static void serve(int listen_fd, const function<string()> &render, const function<void()> &tick,
+                      const atomic<bool> &done);
+};
+
+#endif //METRICS_H
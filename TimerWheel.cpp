@@ -0,0 +1,68 @@
+//
+// Hierarchical timer wheel for the controller's liveness and lease expiry deadlines.
+//
+#include "TimerWheel.h"
+#include <algorithm>
+
+TimerWheel::TimerWheel(chrono::milliseconds tick, chrono::steady_clock::time_point now)
+        : tick(max(tick, chrono::milliseconds(1))), origin(now) {}
+
+/**
+ * Ticks since the wheel started. Deadlines round up and the clock rounds down, so a
+ * timer never fires before its deadline.
+ */
+uint64_t TimerWheel::tick_of(chrono::steady_clock::time_point when, bool round_up) const {
+    if (when <= origin) return 0;
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(when - origin);
+    if (round_up) elapsed += tick - chrono::milliseconds(1);
+    return static_cast<uint64_t>(elapsed / tick);
+}
+
+/**
+ * Puts a timer in the lowest wheel whose span reaches its due tick. Due ticks before
+ * `earliest` go in its slot: the current tick while cascading into it, else the next.
+ */
+void TimerWheel::place(const Timer &timer, uint64_t earliest) {
+    uint64_t due = max(timer.due, earliest);
+    uint64_t delta = due - current;
+    for (int level = 0; level < LEVELS; ++level) {
+        uint64_t span = SLOTS << (SLOT_BITS * level);
+        if (delta < span || level == LEVELS - 1) {
+            // Past the top wheel's span, park it in the farthest slot; it cascades back later.
+            if (delta >= span) due = current + span - 1;
+            wheels[level][(due >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back({timer.key, timer.due});
+            return;
+        }
+    }
+}
+
+void TimerWheel::schedule(uint64_t key, chrono::steady_clock::time_point when) {
+    place({key, tick_of(when, true)}, current + 1);
+    ++pending;
+}
+
+void TimerWheel::advance(chrono::steady_clock::time_point now, vector<uint64_t> &expired) {
+    uint64_t target = tick_of(now, false);
+    while (current < target) {
+        ++current;
+        // Entering a new slot of a higher wheel: spread its timers over the wheels below.
+        for (int level = 1; level < LEVELS; ++level) {
+            if (current & ((uint64_t{1} << (SLOT_BITS * level)) - 1)) break;
+            auto &slot = wheels[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)];
+            vector<Timer> cascading;
+            cascading.swap(slot);
+            for (const auto &timer : cascading) place(timer, current);
+        }
+        auto &slot = wheels[0][current & (SLOTS - 1)];
+        vector<Timer> due;
+        due.swap(slot);
+        for (const auto &timer : due) {
+            if (timer.due > current) {
+                place(timer, current + 1); // Parked past the span; not due yet.
+                continue;
+            }
+            expired.push_back(timer.key);
+            --pending;
+        }
+    }
+}
@@ -0,0 +1,63 @@
+//
+// Hierarchical timer wheel for the controller's liveness and lease expiry deadlines.
+//
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Deadlines bucketed by tick in LEVELS wheels of SLOTS slots each: the first wheel
+ * holds the next SLOTS ticks, and each wheel above covers SLOTS times the span of the
+ * one below, cascading its slots down as time reaches them. Scheduling is O(1) and
+ * advancing costs the ticks passed plus the timers that fire or cascade, however
+ * many are pending.
+ *
+ * Timers can't be cancelled. Callers check a fired key against their own state and
+ * reschedule or drop it, which is cheaper than cancellation when most deadlines move
+ * (a node's liveness deadline moves with every message it sends).
+ */
+class TimerWheel {
+public:
+    explicit TimerWheel(chrono::milliseconds tick, chrono::steady_clock::time_point now = chrono::steady_clock::now());
+
+    /**
+     * Fires `key` at the first advance at or past `when`. Deadlines in the past fire
+     * on the next advance; ones beyond the wheels' span are held at the span's end.
+     */
+    void schedule(uint64_t key, chrono::steady_clock::time_point when);
+
+    /**
+     * Moves the wheel to `now` and appends the keys that are due to `expired`.
+     */
+    void advance(chrono::steady_clock::time_point now, vector<uint64_t> &expired);
+
+    [[nodiscard]] size_t size() const { return pending; }
+
+private:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 6;
+    static constexpr uint64_t SLOTS = 1 << SLOT_BITS;
+
+    struct Timer {
+        uint64_t key;
+        uint64_t due;  // Tick.
+    };
+
+    chrono::milliseconds tick;
+    chrono::steady_clock::time_point origin;
+    uint64_t current = 0;                      // Every tick up to here has been processed.
+    size_t pending = 0;
+    array<array<vector<Timer>, SLOTS>, LEVELS> wheels;
+
+    [[nodiscard]] uint64_t tick_of(chrono::steady_clock::time_point when, bool round_up) const;
+    void place(const Timer &timer, uint64_t earliest);
+};
+
+#endif //TIMERWHEEL_H
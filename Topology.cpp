@@ -0,0 +1,199 @@
+//
+// CPU topology detection and thread pinning for the node's worker pool.
+//
+#include "Topology.h"
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sched.h>
+#include <pthread.h>
+#include <thread>
+
+namespace {
+    const string CPU_ROOT = "/sys/devices/system/cpu/";
+
+    int read_int(const string &path, int fallback) {
+        ifstream in(path);
+        int value;
+        if (in >> value) return value;
+        return fallback;
+    }
+
+    /**
+     * NUMA node of a CPU, from the nodeN link in its sysfs directory.
+     */
+    int read_numa_node(int cpu) {
+        error_code ec;
+        for (const auto &entry : filesystem::directory_iterator(CPU_ROOT + "cpu" + to_string(cpu), ec)) {
+            string name = entry.path().filename().string();
+            if (name.rfind("node", 0) == 0 && name.size() > 4 && isdigit(name[4])) return stoi(name.substr(4));
+        }
+        return 0;
+    }
+
+    /**
+     * Orders CPUs so the first thread of every core comes before any SMT sibling,
+     * spreading consecutive threads across sockets.
+     */
+    vector<int> physical_first(vector<Topology::Cpu> cpus) {
+        sort(cpus.begin(), cpus.end(), [](const Topology::Cpu &a, const Topology::Cpu &b) {
+            return tie(a.smt_rank, a.core, a.package, a.id) < tie(b.smt_rank, b.core, b.package, b.id);
+        });
+        vector<int> order;
+        order.reserve(cpus.size());
+        for (const auto &cpu : cpus) order.push_back(cpu.id);
+        return order;
+    }
+}
+
+Topology Topology::detect() {
+    Topology topology;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    int max_cpu = have_mask ? CPU_SETSIZE : static_cast<int>(thread::hardware_concurrency());
+    for (int cpu = 0; cpu < max_cpu; ++cpu) {
+        if (have_mask && !CPU_ISSET(cpu, &allowed)) continue;
+        string topo = CPU_ROOT + "cpu" + to_string(cpu) + "/topology/";
+        topology.cpus.push_back({cpu, read_int(topo + "physical_package_id", 0),
+                                 read_int(topo + "core_id", cpu), read_numa_node(cpu), 0});
+    }
+
+    // Rank SMT siblings within each (package, core) by CPU id.
+    map<pair<int, int>, int> seen;
+    for (auto &cpu : topology.cpus) {
+        cpu.smt_rank = seen[{cpu.package, cpu.core}]++;
+    }
+    return topology;
+}
+
+bool Topology::parse_pinning(const string &name, Pinning &policy) {
+    if (name == "none") policy = NONE;
+    else if (name == "physical") policy = PHYSICAL;
+    else if (name == "socket") policy = SOCKET;
+    else if (name == "all") policy = ALL;
+    else return false;
+    return true;
+}
+
+string Topology::pinning_name(Pinning policy) {
+    switch (policy) {
+        case PHYSICAL: return "physical";
+        case SOCKET: return "socket";
+        case ALL: return "all";
+        default: return "none";
+    }
+}
+
+vector<int> Topology::placement(Pinning policy) const {
+    switch (policy) {
+        case PHYSICAL:
+            return physical_first(cpus);
+        case SOCKET: {
+            // Use the socket with the most CPUs we are allowed to run on.
+            map<int, int> per_package;
+            for (const auto &cpu : cpus) per_package[cpu.package]++;
+            if (per_package.empty()) return {};
+            int package = max_element(per_package.begin(), per_package.end(),
+                                      [](const auto &a, const auto &b) { return a.second < b.second; })->first;
+            vector<Cpu> local;
+            copy_if(cpus.begin(), cpus.end(), back_inserter(local),
+                    [package](const Cpu &cpu) { return cpu.package == package; });
+            return physical_first(local);
+        }
+        case ALL: {
+            vector<Cpu> sorted = cpus;
+            sort(sorted.begin(), sorted.end(), [](const Cpu &a, const Cpu &b) {
+                return tie(a.package, a.core, a.smt_rank) < tie(b.package, b.core, b.smt_rank);
+            });
+            vector<int> order;
+            for (const auto &cpu : sorted) order.push_back(cpu.id);
+            return order;
+        }
+        default:
+            return {};
+    }
+}
+
+int Topology::numa_node_of(int cpu) const {
+    for (const auto &c : cpus) {
+        if (c.id == cpu) return c.numa_node;
+    }
+    return 0;
+}
+
+/**
+ * One-line summary reported to the controller, e.g.
+ * "policy=physical cpus=0,2,4,6 sockets=0 numa=0 cores=4/8".
+ */
+string Topology::describe(Pinning policy, const vector<int> &order, int threads) const {
+    string result = "policy=" + pinning_name(policy);
+    if (order.empty()) return result + " cpus=unpinned";
+
+    set<int> packages, numa_nodes, used;
+    for (int i = 0; i < threads; ++i) used.insert(order[i % order.size()]);
+    set<pair<int, int>> cores, all_cores;
+    for (const auto &cpu : cpus) {
+        all_cores.insert({cpu.package, cpu.core});
+        if (!used.count(cpu.id)) continue;
+        packages.insert(cpu.package);
+        numa_nodes.insert(cpu.numa_node);
+        cores.insert({cpu.package, cpu.core});
+    }
+
+    auto join = [](const set<int> &values) {
+        string out;
+        for (int v : values) out.append(out.empty() ? "" : ",").append(to_string(v));
+        return out;
+    };
+    result += " cpus=" + join(used) + " sockets=" + join(packages) + " numa=" + join(numa_nodes);
+    result += " cores=" + to_string(cores.size()) + "/" + to_string(all_cores.size());
+    return result;
+}
+
+int Topology::physical_cores() const {
+    set<pair<int, int>> cores;
+    for (const auto &cpu : cpus) cores.insert({cpu.package, cpu.core});
+    return static_cast<int>(cores.size());
+}
+
+double Topology::cpu_quota() {
+    // Find our cgroup paths: "0::/path" for v2, "N:cpu,cpuacct:/path" for v1.
+    ifstream cgroups("/proc/self/cgroup");
+    string line, v2_path, v1_path;
+    while (getline(cgroups, line)) {
+        size_t first = line.find(':'), second = line.find(':', first + 1);
+        if (first == string::npos || second == string::npos) continue;
+        string controllers = line.substr(first + 1, second - first - 1);
+        string path = line.substr(second + 1);
+        if (controllers.empty()) v2_path = path;
+        else if (controllers == "cpu" || controllers.find("cpu,") == 0 || controllers.find(",cpu") != string::npos)
+            v1_path = path;
+    }
+
+    ifstream v2("/sys/fs/cgroup" + v2_path + "/cpu.max");
+    string quota;
+    long long period;
+    if (v2 >> quota >> period) {
+        if (quota == "max" || period <= 0) return 0;
+        return stod(quota) / static_cast<double>(period);
+    }
+
+    for (const char *root : {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct"}) {
+        long long v1_quota = read_int(root + v1_path + "/cpu.cfs_quota_us", -1);
+        long long v1_period = read_int(root + v1_path + "/cpu.cfs_period_us", -1);
+        if (v1_period > 0) return v1_quota > 0 ? static_cast<double>(v1_quota) / static_cast<double>(v1_period) : 0;
+    }
+    return 0;
+}
+
+bool Topology::pin_current_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
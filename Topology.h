@@ -0,0 +1,64 @@
+//
+// CPU topology detection and thread pinning for the node's worker pool.
+//
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class Topology {
+public:
+    enum Pinning {
+        NONE,     // Leave placement to the scheduler.
+        PHYSICAL, // One hardware thread per physical core across all sockets, SMT siblings last.
+        SOCKET,   // Like PHYSICAL, restricted to a single socket.
+        ALL,      // Every hardware thread, SMT siblings kept together.
+    };
+
+    struct Cpu {
+        int id;
+        int package;   // Socket, from physical_package_id.
+        int core;      // core_id, unique within a package.
+        int numa_node;
+        int smt_rank;  // 0 for the first thread of a core, 1 for its sibling, ...
+    };
+
+    /**
+     * CPUs this process may run on, read from /sys/devices/system/cpu and
+     * filtered by the current affinity mask.
+     */
+    vector<Cpu> cpus;
+
+    static Topology detect();
+
+    /**
+     * @return false if `name` isn't none, physical, socket or all.
+     */
+    static bool parse_pinning(const string &name, Pinning &policy);
+
+    static string pinning_name(Pinning policy);
+
+    /**
+     * CPU ids in the order pool threads should be pinned to them.
+     * Thread i goes to order[i % order.size()]. Empty for NONE.
+     */
+    [[nodiscard]] vector<int> placement(Pinning policy) const;
+    [[nodiscard]] int numa_node_of(int cpu) const;
+    [[nodiscard]] string describe(Pinning policy, const vector<int> &order, int threads) const;
+
+    [[nodiscard]] int physical_cores() const;
+
+    /**
+     * CPU limit from the cgroup (v2 cpu.max or v1 cfs quota), in cores.
+     * 0 when the process isn't throttled.
+     */
+    static double cpu_quota();
+
+    static bool pin_current_thread(int cpu);
+};
+
+#endif //TOPOLOGY_H
@@ -0,0 +1,157 @@
+//
+// Stream transports between nodes and the controller.
+//
+
+#include "Transport.h"
+#include "Log.h"
+#include <iostream>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+Transport::Endpoint Transport::parse(const string &address, int port) {
+    if (address.rfind("unix:", 0) == 0) return {UNIX, address.substr(5), 0};
+    return {TCP, address, port};
+}
+
+string Transport::describe(const Endpoint &endpoint) {
+    if (endpoint.kind == UNIX) return "unix:" + endpoint.address;
+    return endpoint.address + " on port: " + to_string(endpoint.port);
+}
+
+/**
+ * Fills a sockaddr_un, refusing paths that don't fit in sun_path.
+ */
+static bool unix_address(const string &path, sockaddr_un &addr) {
+    addr = sockaddr_un{};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        LOG(ERROR) << "Unix socket path must be 1 to " << sizeof(addr.sun_path) - 1 << " characters: " << path;
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+int Transport::connect_to(const Endpoint &endpoint) {
+    sockaddr_storage addr{};
+    socklen_t addr_size;
+    int family;
+    if (endpoint.kind == UNIX) {
+        family = AF_UNIX;
+        if (!unix_address(endpoint.address, reinterpret_cast<sockaddr_un &>(addr))) return -1;
+        addr_size = sizeof(sockaddr_un);
+    } else if (endpoint.address.find(':') != string::npos) {
+        family = AF_INET6;
+        auto &addr6 = reinterpret_cast<sockaddr_in6 &>(addr);
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_port = htons(endpoint.port);
+        if (inet_pton(AF_INET6, endpoint.address.c_str(), &addr6.sin6_addr) <= 0) {
+            LOG(ERROR) << "Invalid IPv6 address format.";
+            return -1;
+        }
+        addr_size = sizeof(sockaddr_in6);
+    } else {
+        family = AF_INET;
+        auto &addr4 = reinterpret_cast<sockaddr_in &>(addr);
+        addr4.sin_family = AF_INET;
+        addr4.sin_port = htons(endpoint.port);
+        if (inet_pton(AF_INET, endpoint.address.c_str(), &addr4.sin_addr) <= 0) {
+            LOG(ERROR) << "Invalid IPv4 address format.";
+            return -1;
+        }
+        addr_size = sizeof(sockaddr_in);
+    }
+
+    int sock = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        LOG(ERROR) << "Socket failed: " << strerror(errno);
+        return -1;
+    }
+    if (connect(sock, reinterpret_cast<sockaddr *>(&addr), addr_size) < 0) {
+        LOG(WARN) << "Connection failed with " << describe(endpoint) << ": " << strerror(errno);
+        close(sock);
+        return -1;
+    }
+    configure(sock, endpoint.kind);
+    return sock;
+}
+
+int Transport::listen_tcp(int port, int backlog) {
+    int sock = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        LOG(ERROR) << "Socket creation failed: " << strerror(errno);
+        return -1;
+    }
+    int opt = 0;
+    setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+    int reuse = 1; // A restarted controller must be able to rebind while old connections sit in TIME_WAIT.
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    sockaddr_in6 server_addr{};
+    server_addr.sin6_family = AF_INET6;
+    server_addr.sin6_port = htons(port);
+    server_addr.sin6_addr = in6addr_any;
+    if (bind(sock, (sockaddr *) &server_addr, sizeof(server_addr)) < 0 || listen(sock, backlog) < 0) {
+        LOG(ERROR) << "Bind failed on port " << port << ": " << strerror(errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int Transport::listen_loopback(int port, int backlog) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        LOG(ERROR) << "Socket creation failed: " << strerror(errno);
+        return -1;
+    }
+    int reuse = 1; // Rebinding past TIME_WAIT only; unlike SO_REUSEPORT it doesn't share the port.
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (sockaddr *) &server_addr, sizeof(server_addr)) < 0 || listen(sock, backlog) < 0) {
+        LOG(ERROR) << "Bind failed on 127.0.0.1 port " << port << ": " << strerror(errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int Transport::listen_unix(const string &path, int backlog) {
+    sockaddr_un addr{};
+    if (!unix_address(path, addr)) return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        LOG(ERROR) << "Socket creation failed: " << strerror(errno);
+        return -1;
+    }
+    struct stat existing{};
+    if (lstat(path.c_str(), &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            LOG(ERROR) << "Not replacing " << path << ": it exists and isn't a socket";
+            close(sock);
+            return -1;
+        }
+        unlink(path.c_str()); // A socket file outlives the process that bound it.
+    }
+    if (bind(sock, (sockaddr *) &addr, sizeof(addr)) < 0 || listen(sock, backlog) < 0) {
+        LOG(ERROR) << "Bind failed on " << path << ": " << strerror(errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+void Transport::configure(int fd, Kind kind) {
+    if (kind != TCP) return;
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+}
@@ -0,0 +1,70 @@
+//
+// Stream transports between nodes and the controller: TCP for remote nodes and
+// Unix-domain sockets for nodes on the controller's own host.
+//
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <string>
+
+using namespace std;
+
+/**
+ * Both transports carry the same length-prefixed frames, so once a socket is
+ * connected or accepted nothing above this layer knows which one it is.
+ */
+class Transport {
+public:
+    enum Kind {
+        TCP,  // IPv4 or IPv6, for nodes on other hosts.
+        UNIX, // Unix-domain stream socket: skips the loopback TCP stack for co-located nodes.
+    };
+
+    struct Endpoint {
+        Kind kind;
+        string address; // Host for TCP, socket path for UNIX.
+        int port;       // TCP only.
+    };
+
+    /**
+     * "unix:PATH" names a Unix-domain socket; anything else is an IPv4 or IPv6 address.
+     */
+    static Endpoint parse(const string &address, int port);
+    static string describe(const Endpoint &endpoint);
+
+    /**
+     * Connects a blocking stream socket to the endpoint and applies configure().
+     * @return the socket, or -1 with the reason printed.
+     */
+    static int connect_to(const Endpoint &endpoint);
+
+    /**
+     * Non-blocking dual-stack listener on every address. SO_REUSEPORT lets several
+     * listeners in one process share the port, one per I/O thread.
+     * @return the socket, or -1 with the reason printed.
+     */
+    static int listen_tcp(int port, int backlog);
+
+    /**
+     * Non-blocking listener on 127.0.0.1 only, for endpoints meant for this machine.
+     * No SO_REUSEPORT, so another process can't bind the port alongside it.
+     * @return the socket, or -1 with the reason printed.
+     */
+    static int listen_loopback(int port, int backlog);
+
+    /**
+     * Non-blocking listener on a socket file, replacing one left by an earlier run.
+     * Refuses a path that holds anything but a socket.
+     * @return the socket, or -1 with the reason printed.
+     */
+    static int listen_unix(const string &path, int backlog);
+
+    /**
+     * Per-connection options for a connected or accepted socket. TCP disables Nagle:
+     * frames are small and each one waits on a reply.
+     */
+    static void configure(int fd, Kind kind);
+};
+
+#endif //TRANSPORT_H
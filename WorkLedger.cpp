@@ -0,0 +1,239 @@
+//
+// Interval ledger of the keyspace: which ranges are free, leased to a node, or done.
+//
+#include "WorkLedger.h"
+#include <algorithm>
+
+WorkLedger::WorkLedger(long long keyspace_end) : end_(keyspace_end) {}
+
+/**
+ * Makes sure a segment starts exactly at `at`, splitting the one that covers it.
+ * @return Iterator to the segment starting at `at`, or end() when at >= frontier.
+ */
+WorkLedger::Iter WorkLedger::split(long long at) {
+    if (at >= frontier_) return segments.end();
+    auto it = prev(segments.upper_bound(at));
+    if (it->first == at) return it;
+
+    unindex(it);
+    Segment tail = it->second;
+    it->second.end = at - 1;
+    index(it);
+    auto inserted = segments.emplace_hint(next(it), at, tail);
+    index(inserted);
+    return inserted;
+}
+
+/**
+ * Overwrites [start, end] with one segment, then merges it with equal neighbours.
+ */
+void WorkLedger::assign(long long start, long long end, State state, int owner,
+                        chrono::steady_clock::time_point since) {
+    end = min(end, frontier_ - 1);
+    if (start < 0) start = 0;
+    if (start > end) return;
+
+    auto first = split(start);
+    auto last = split(end + 1);
+    for (auto it = first; it != last; ++it) unindex(it);
+    segments.erase(first, last);
+
+    auto it = segments.emplace(start, Segment{end, state, owner, since}).first;
+    index(it);
+    merge_with_next(it);
+    if (it != segments.begin()) merge_with_next(prev(it));
+}
+
+void WorkLedger::merge_with_next(Iter it) {
+    auto next_it = next(it);
+    if (next_it == segments.end() || next_it->first != it->second.end + 1) return;
+    const Segment &a = it->second, &b = next_it->second;
+    if (a.state != b.state || (a.state == LEASED && a.owner != b.owner)) return;
+
+    unindex(it);
+    unindex(next_it);
+    it->second.end = b.end;
+    it->second.since = min(a.since, b.since);
+    segments.erase(next_it);
+    index(it);
+}
+
+void WorkLedger::index(Iter it) {
+    const Segment &segment = it->second;
+    totals[segment.state] += segment.end - it->first + 1;
+    if (segment.state == FREE) free_starts.insert(it->first);
+    if (segment.state == LEASED) {
+        owned[segment.owner].insert(it->first);
+        held_[segment.owner] += segment.end - it->first + 1;
+    }
+}
+
+void WorkLedger::unindex(Iter it) {
+    const Segment &segment = it->second;
+    totals[segment.state] -= segment.end - it->first + 1;
+    if (segment.state == FREE) free_starts.erase(it->first);
+    if (segment.state == LEASED) {
+        auto owner = owned.find(segment.owner);
+        owner->second.erase(it->first);
+        if (owner->second.empty()) {
+            owned.erase(owner);
+            held_.erase(segment.owner);
+        } else {
+            held_[segment.owner] -= segment.end - it->first + 1;
+        }
+    }
+}
+
+optional<pair<long long, long long>> WorkLedger::lease(int owner, long long size, bool *reused) {
+    size = max(1LL, size);
+    auto now = chrono::steady_clock::now();
+
+    if (!free_starts.empty()) {
+        long long start = *free_starts.begin();
+        long long end = segments.at(start).end;
+        if (end - start + 1 > size) end = start + size - 1;
+        assign(start, end, LEASED, owner, now);
+        if (reused) *reused = true;
+        return pair{start, end};
+    }
+
+    if (frontier_ >= end_) return nullopt;
+    long long start = frontier_;
+    long long end = (size > end_ - start) ? end_ - 1 : start + size - 1;
+    frontier_ = end + 1;
+    auto it = segments.emplace_hint(segments.end(), start, Segment{end, LEASED, owner, now});
+    index(it);
+    if (it != segments.begin()) merge_with_next(prev(it));
+    if (reused) *reused = false;
+    return pair{start, end};
+}
+
+void WorkLedger::complete(long long start, long long end) {
+    assign(start, end, DONE, -1, {});
+}
+
+void WorkLedger::release(int owner) {
+    auto it = owned.find(owner);
+    if (it == owned.end()) return;
+    // Leases of one owner are never adjacent, so freeing one can't merge away another's key.
+    vector<long long> starts(it->second.begin(), it->second.end());
+    for (long long start : starts) {
+        assign(start, segments.at(start).end, FREE, -1, {});
+    }
+}
+
+void WorkLedger::retain(int owner, vector<pair<long long, long long>> kept) {
+    sort(kept.begin(), kept.end());
+    vector<pair<long long, long long>> dropped;
+    for (const auto &lease : leases(owner)) {
+        auto [from, to] = lease.range;
+        for (const auto &[start, end] : kept) {
+            if (end < from) continue;
+            if (start > to) break;
+            if (start > from) dropped.emplace_back(from, start - 1);
+            from = end + 1;
+            if (from > to) break;
+        }
+        if (from <= to) dropped.emplace_back(from, to);
+    }
+    for (const auto &[start, end] : dropped) assign(start, end, FREE, -1, {});
+}
+
+void WorkLedger::claim(int owner, long long start, long long end) {
+    if (start > end || start < 0) return;
+    extend(end);
+    auto now = chrono::steady_clock::now();
+    vector<pair<long long, long long>> free_parts;
+    auto it = segments.upper_bound(start);
+    if (it != segments.begin()) --it;
+    for (; it != segments.end() && it->first <= end; ++it) {
+        if (it->second.state != FREE) continue;
+        free_parts.emplace_back(max(start, it->first), min(end, it->second.end));
+    }
+    for (const auto &[s, e] : free_parts) assign(s, e, LEASED, owner, now);
+}
+
+void WorkLedger::transfer(int owner, long long start, long long end) {
+    auto now = chrono::steady_clock::now();
+    for (const auto &lease : leased_within(start, end)) {
+        assign(lease.range.first, lease.range.second, LEASED, owner, now);
+    }
+}
+
+vector<WorkLedger::Lease> WorkLedger::leases(int owner) const {
+    vector<Lease> result;
+    auto it = owned.find(owner);
+    if (it == owned.end()) return result;
+    for (long long start : it->second) {
+        const Segment &segment = segments.at(start);
+        result.push_back({{start, segment.end}, segment.since, owner});
+    }
+    return result;
+}
+
+long long WorkLedger::held(int owner) const {
+    auto it = held_.find(owner);
+    return it == held_.end() ? 0 : it->second;
+}
+
+vector<WorkLedger::Lease> WorkLedger::leased_within(long long start, long long end) const {
+    vector<Lease> result;
+    auto it = segments.upper_bound(start);
+    if (it != segments.begin()) --it;
+    for (; it != segments.end() && it->first <= end; ++it) {
+        const Segment &segment = it->second;
+        if (segment.state != LEASED || segment.end < start) continue;
+        result.push_back({{max(start, it->first), min(end, segment.end)}, segment.since, segment.owner});
+    }
+    return result;
+}
+
+vector<pair<long long, long long>> WorkLedger::ranges(State state) const {
+    vector<pair<long long, long long>> result;
+    for (const auto &[start, segment] : segments) {
+        if (segment.state == state) result.emplace_back(start, segment.end);
+    }
+    return result;
+}
+
+void WorkLedger::grant(long long start, long long end) {
+    if (start > end || start < 0) return;
+    end_ = max(end_, end + 1);
+    if (start > frontier_) {
+        long long gap = frontier_;
+        extend(start - 1);
+        assign(gap, start - 1, DONE, -1, {});
+    }
+    extend(end);
+    vector<pair<long long, long long>> granted;
+    auto it = segments.upper_bound(start);
+    if (it != segments.begin()) --it;
+    for (; it != segments.end() && it->first <= end; ++it) {
+        if (it->second.state != DONE) continue;
+        granted.emplace_back(max(start, it->first), min(end, it->second.end));
+    }
+    for (const auto &[s, e] : granted) assign(s, e, FREE, -1, {});
+}
+
+void WorkLedger::extend(long long end) {
+    end = min(end, end_ - 1);
+    if (end < frontier_) return;
+    long long start = frontier_;
+    frontier_ = end + 1;
+    auto it = segments.emplace_hint(segments.end(), start, Segment{end, FREE, -1, {}});
+    index(it);
+    if (it != segments.begin()) merge_with_next(prev(it));
+}
+
+long long WorkLedger::available() const {
+    return totals[FREE] + (end_ - frontier_);
+}
+
+double WorkLedger::coverage() const {
+    long long total = bounded() ? end_ : frontier_;
+    return total > 0 ? static_cast<double>(totals[DONE]) / static_cast<double>(total) : 0.0;
+}
+
+bool WorkLedger::exhausted() const {
+    return bounded() && frontier_ >= end_ && totals[FREE] == 0 && totals[LEASED] == 0;
+}
@@ -0,0 +1,161 @@
+//
+// Interval ledger of the keyspace: which ranges are free, leased to a node, or done.
+//
+
+#ifndef WORKLEDGER_H
+#define WORKLEDGER_H
+
+#include <chrono>
+#include <climits>
+#include <map>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Tracks the keyspace [0, frontier) as maximal runs of candidates in one state.
+ * Everything from the frontier up to the keyspace end is implicitly free and is
+ * handed out by advancing the frontier. Adjacent runs in the same state (and for
+ * leases, with the same owner) are merged, so a job that completes in order stays
+ * at a handful of segments however many checkpoints it took.
+ *
+ * Splitting, merging, leasing and completing are O(log n) in the number of segments,
+ * plus the number of segments a call overwrites. Ranges are inclusive pairs, like
+ * the rest of the protocol.
+ */
+class WorkLedger {
+public:
+    enum State : unsigned char {
+        FREE,    // Searched by nobody and not leased: returned by a node that went away.
+        LEASED,  // Handed to a node that hasn't reported it done yet.
+        DONE,    // Reported searched.
+    };
+
+    struct Lease {
+        pair<long long, long long> range;
+        chrono::steady_clock::time_point since;
+        int owner;
+    };
+
+    explicit WorkLedger(long long keyspace_end = LLONG_MAX);
+
+    /**
+     * Leases up to `size` candidates to `owner`, reusing the lowest free range
+     * before advancing the frontier.
+     * @param reused Set to whether the range came from returned work.
+     * @return nullopt when nothing is left to hand out.
+     */
+    optional<pair<long long, long long>> lease(int owner, long long size, bool *reused = nullptr);
+
+    /**
+     * Marks a range searched, whoever holds it. Parts beyond the frontier are ignored.
+     */
+    void complete(long long start, long long end);
+
+    /**
+     * Returns every range leased to `owner` to the free pool.
+     */
+    void release(int owner);
+
+    /**
+     * Returns the parts of `owner`'s leases outside `kept` to the free pool, for a node
+     * that reconnected without them: they went with a lost ASSIGN or REQUEST.
+     */
+    void retain(int owner, vector<pair<long long, long long>> kept);
+
+    /**
+     * Leases the free parts of [start, end] to `owner`, for a node presenting a range
+     * it was working on before a reconnect. Ranges past the frontier (lost from the
+     * journal tail) are claimable too. Parts held by others or done are left alone.
+     */
+    void claim(int owner, long long start, long long end);
+
+    /**
+     * Hands the leased parts of [start, end] to `owner`, for splitting one node's lease
+     * with another. Free and done parts are left alone.
+     */
+    void transfer(int owner, long long start, long long end);
+
+    [[nodiscard]] vector<Lease> leases(int owner) const;
+
+    /**
+     * Candidates leased to `owner`, without walking its leases.
+     */
+    [[nodiscard]] long long held(int owner) const;
+
+    /**
+     * Leased parts of [start, end], whoever holds them, clipped to the range.
+     */
+    [[nodiscard]] vector<Lease> leased_within(long long start, long long end) const;
+
+    /**
+     * Every range currently in `state`, in order. Used to snapshot the ledger.
+     */
+    [[nodiscard]] vector<pair<long long, long long>> ranges(State state) const;
+
+    /**
+     * Adds [start, end] to the free pool, for a relay whose keyspace is only what its
+     * parent leased it (construct it with keyspace_end 0). The keyspace grows to cover
+     * the range, and candidates skipped to reach it are marked done: they belong to
+     * other parts of the tree. Parts already leased to a local node are left alone.
+     */
+    void grant(long long start, long long end);
+
+    /**
+     * Moves the frontier past `end`, marking the candidates it skips as free.
+     * Used when restoring a ledger from a journal.
+     */
+    void extend(long long end);
+
+    [[nodiscard]] long long keyspace_end() const { return end_; }
+    [[nodiscard]] long long frontier() const { return frontier_; }
+    [[nodiscard]] bool bounded() const { return end_ != LLONG_MAX; }
+    [[nodiscard]] long long searched() const { return totals[DONE]; }
+    [[nodiscard]] long long leased() const { return totals[LEASED]; }
+    [[nodiscard]] long long returned() const { return totals[FREE]; }
+
+    /**
+     * Candidates nobody holds: returned ranges plus everything past the frontier.
+     */
+    [[nodiscard]] long long available() const;
+
+    /**
+     * Fraction of the keyspace reported searched. Unbounded jobs report against the frontier.
+     */
+    [[nodiscard]] double coverage() const;
+
+    /**
+     * Bounded keyspace fully handed out and every lease reported done.
+     */
+    [[nodiscard]] bool exhausted() const;
+
+    [[nodiscard]] size_t fragments() const { return segments.size(); }
+
+private:
+    struct Segment {
+        long long end;                         // Inclusive.
+        State state;
+        int owner;                             // Only meaningful for LEASED.
+        chrono::steady_clock::time_point since; // When a LEASED segment was handed out.
+    };
+    using Iter = map<long long, Segment>::iterator;
+
+    map<long long, Segment> segments;          // Keyed by start, covering [0, frontier_) without gaps.
+    set<long long> free_starts;                // Starts of FREE segments, lowest first.
+    unordered_map<int, set<long long>> owned;  // Starts of LEASED segments per owner.
+    unordered_map<int, long long> held_;       // LEASED candidates per owner.
+    long long totals[3]{};                     // Candidates per state.
+    long long frontier_ = 0;
+    long long end_;
+
+    Iter split(long long at);
+    void assign(long long start, long long end, State state, int owner, chrono::steady_clock::time_point since);
+    void merge_with_next(Iter it);
+    void index(Iter it);
+    void unindex(Iter it);
+};
+
+#endif //WORKLEDGER_H
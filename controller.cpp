@@ -1,126 +1,290 @@
 #include <iostream>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <atomic>
 #include <vector>
 #include <mutex>
+#include <thread>
+#include <optional>
 #include <unordered_map>
+#include <deque>
 #include "Message.h"
+#include "WorkLedger.h"
+#include "Journal.h"
+#include "Transport.h"
+#include "Log.h"
+#include "TimerWheel.h"
+#include "Metrics.h"
+#include <memory>
+#include <random>
 #include <algorithm>
 #include <cstring>
 #include <csignal>
+#include <climits>
+#include <cmath>
+#include <cctype>
 
 using namespace std;
-#define MAX_CLIENTS 10
+#define LISTEN_BACKLOG 4096 // Capped by net.core.somaxconn; absorbs reconnect storms.
+#define MAX_EVENTS 1024
+#define MAX_FRAME_SIZE (10 * 1024 * 1024)
+#define MAX_PENDING_OUTPUT (4 * 1024 * 1024) // A node this far behind on reading is dropped.
+#define SHUTDOWN_FLUSH_MS 2000
+#define LIVENESS_TICK_MS 100
+#define RELAY_RECONNECT_SECONDS 120
+#define RELAY_HEARTBEAT_SECONDS 5
 
 // Global Data
 string correct_password;
 atomic<bool> password_found(false);
+atomic<bool> keyspace_done(false);
+/**
+ * Guards the job state every shard shares: the ledger, journal, sessions and cluster
+ * totals. Per-connection state belongs to one shard's thread and is never locked.
+ * Never held across a send, since a failed send drops the connection, which locks it.
+ */
 mutex global_mutex;
 atomic<bool> shutdown_requested(false);
 
 // Node Tracking
-unordered_map<int, pair<long long, long long>> active_nodes;
-unordered_map<int, chrono::steady_clock::time_point> node_last_seen;
-vector<pair<long long, long long>> remaining_work;
+/**
+ * A node's identity across reconnects. The session id owns the node's leases in the
+ * ledger, so they survive the socket: when a connection drops the leases are kept
+ * for grace_seconds, and a node that comes back with the token picks them up again.
+ */
+struct Session {
+    unsigned long long token;
+    int fd;                                          // -1 while disconnected.
+    int shard;                                       // Shard that owns fd.
+    chrono::steady_clock::time_point disconnected_at;
+    int races_lost = 0;                              // Endgame duplicates that beat this node to a range.
+    double hash_rate = 0;                            // From the node's last heartbeat.
+};
+unordered_map<int, Session> sessions;                // By session id.
+TimerWheel session_expiry{chrono::seconds(1)};       // Grace deadlines of disconnected sessions.
+unordered_map<unsigned long long, int> session_tokens;
+int next_session_id = 1;
+long long grace_seconds = 30;
+mt19937_64 token_rng{random_device{}()};
+
+/**
+ * What the controller knows about a node's performance from its heartbeats.
+ * Fractions are over the interval between the last two heartbeats.
+ */
+struct NodeStats {
+    double hash_rate = 0;         // Sum of the per-thread rates.
+    vector<double> thread_rates;
+    long long tested = 0;         // Cumulative, as reported by the node.
+    long long idle_ms = 0;
+    long long io_ms = 0;
+    double idle_fraction = 0;     // Share of thread time spent waiting for work.
+    double io_fraction = 0;       // Share of wall time the node's I/O thread spent on the socket.
+    chrono::steady_clock::time_point updated;
+};
+
+/**
+ * Everything the controller tracks for one connected socket. Indexed by fd, which the
+ * kernel keeps dense, so per-node lookups are an array access rather than a hash.
+ */
+struct Connection {
+    bool open = false;
+    int session = -1;                                // Bound on first use, see session_of.
+    chrono::steady_clock::time_point last_seen;
+    uint32_t generation = 0;                         // Tells this connection's liveness timer from an earlier fd's.
+    string placement;                                // CPU placement the node reported in its HELLO.
+    NodeStats stats;
+    string in;                                       // Received bytes not yet parsed into frames.
+    string out;                                      // Queued frames; out_sent bytes of it are on the wire.
+    size_t out_sent = 0;
+    bool job_sent = false;                           // The JOB descriptor went out on this connection.
+};
+
+/**
+ * Work another thread hands to a shard for one of its connections, if it still
+ * belongs to the session: the fd may have been closed and reused in the meantime.
+ */
+struct Posted {
+    int fd;
+    int session;
+    optional<Message> message;                       // Sent to the node; without one the connection is closed.
+};
+
+/**
+ * One I/O thread. Each shard has its own SO_REUSEPORT listening socket, so the kernel
+ * spreads new nodes across shards, and only the shard's thread touches its connections.
+ * Other shards reach it through the inbox.
+ */
+struct Shard {
+    int id = 0;
+    int epoll_fd = -1;
+    int listen_fd = -1;
+    int unix_fd = -1;                                // Unix-domain listener for co-located nodes, shard 0 only.
+    int wake_fd = -1;                                // eventfd: inbox has work, or the job is over.
+    bool accept_pending = false;                     // Ran out of fds mid-accept; the edges won't fire again.
+    vector<Connection> connections;                  // By fd.
+    mutex inbox_mutex;
+    vector<Posted> inbox;
+    TimerWheel liveness{chrono::milliseconds(LIVENESS_TICK_MS)}; // One timer per connection, see expire_connections.
+    chrono::seconds node_timeout{};
+    uint32_t next_generation = 0;
+};
+vector<unique_ptr<Shard>> shards;
+thread_local Shard *shard = nullptr;                 // The calling thread's shard.
+atomic<size_t> connected_nodes{0};
+double cluster_rate = 0;                             // Sum of the connected nodes' hash rates.
+WorkLedger ledger; // Free, leased and searched ranges of the keyspace.
+unique_ptr<Journal> journal; // Set with --journal, so a restarted controller resumes the job.
 chrono::steady_clock::time_point server_start_time;
 
 // Password Information
 char hashed_password[256], salt[64];
 long long checkpoint_interval;
-static atomic<long long> next_range_start(0);
+Message::Job job; // Sent once per connection; ASSIGNs carry only its id. One job per controller.
+
+// Local nodes
+string unix_path; // --unix: Unix-domain socket served next to the TCP port.
+
+// Work Sizing
+long long unit_seconds = 0;              // Target seconds per unit from a node's hash rate. 0 uses work_size.
+long long window_seconds = 10;           // Work each node should hold in leases, so it asks rarely. 0 is one unit.
+constexpr size_t DEFAULT_LEASE_WINDOW = 2; // Units per node until its first heartbeat: one running, one queued.
+constexpr size_t MAX_LEASE_WINDOW = 16;
+
+// Endgame
+/**
+ * A duplicate lease handed to an idle node once a bounded keyspace has nothing free.
+ * The ledger still records the original holder; whichever node reports first wins.
+ */
+struct Speculation {
+    pair<long long, long long> range;
+    int backup;                          // Session running the duplicate.
+    bool decided = false;                // The backup already beat the holder to part of it.
+};
+vector<Speculation> speculations;        // Guarded by global_mutex.
+constexpr int SLOW_NODE_STRIKES = 3;     // Races lost before a node is flagged slow.
+
+// Splitting
+constexpr long long MIN_SPLIT = 1024;    // Smallest half worth a SHRINK round trip; smaller leases get duplicated.
+unordered_map<int, pair<long long, long long>> pending_splits; // Tail taken from a session, until its node acknowledges.
 
-// Network State
-fd_set read_fds;
-int max_fd, serv_sock;
+// Relay
+bool relay_mode = false;                 // --relay: lease from a parent controller instead of owning the keyspace.
+Transport::Endpoint parent;
+int parent_fd = -1;
+string parent_buffer;                    // Received bytes not yet parsed into frames.
+/**
+ * A REQUEST or CHECKPOINT the parent hasn't answered yet, with the searched ranges it
+ * carried: until the reply comes they may have been lost with the connection.
+ */
+struct Awaiting {
+    Message::MessageType type;
+    vector<pair<long long, long long>> done;
+};
+deque<Awaiting> parent_awaiting;
 
-void reassign_remaining_work(int client_sock);
+unsigned long long parent_session = 0;
+atomic<bool> parent_stopped(false);
+atomic<bool> relay_done(false);
+vector<pair<long long, long long>> upstream_done; // Searched by local nodes, not yet reported to the parent.
+long long cluster_tested = 0;            // Candidates the local nodes tested, summed from their heartbeats.
+long long found_index = -1;
+
+// Metrics
+/**
+ * Counters for the --metrics endpoint. Bumped where the work happens, mostly under
+ * global_mutex already, and read by the metrics thread without it.
+ */
+atomic<bool> metrics_done(false);
+atomic<unsigned long long> ranges_assigned{0};       // Ranges sent in ASSIGNs, fresh or reused.
+atomic<unsigned long long> candidates_assigned{0};
+atomic<unsigned long long> candidates_reassigned{0}; // Returned by a node that went away, then leased again.
+atomic<unsigned long long> candidates_duplicated{0}; // Endgame duplicates; all but one copy is wasted.
+atomic<unsigned long long> candidates_overlapped{0}; // Split tails the holder had already claimed, searched twice.
+Histogram message_latency[Message::SHRINK + 1];      // Time to apply a message under global_mutex, by type.
+deque<pair<chrono::steady_clock::time_point, long long>> progress_samples; // Searched over time; metrics thread only.
+constexpr int ETA_WINDOW_SECONDS = 60;  // Throughput history behind the ETA.
+constexpr int ETA_STEP_SECONDS = 5;     // Throughput is measured over steps this long; the ETA's spread is theirs.
+
+
+void reassign_remaining_work(int session_id);
+int session_of(int fd);
+void drop_connection(int fd);
+Message handle_hello(int fd, const Message::Hello &hello);
 void handle_found(int node_id, long long pwd_idx);
-void assign_work(int node_id, long long work_size);
-vector<string> messages_text{"REQUEST", "ASSIGN", "CHECKPOINT", "FOUND", "STOP", "CONTINUE"};
-constexpr int PRINTABLE_RANGE = 71;
-constexpr int BASE_ASCII = 60;
+Message assign_work(int node_id, long long work_size);
+void release_completed(int node_id, const vector<pair<long long, long long>> &completed);
+void acknowledge_split(int node_id, const vector<pair<long long, long long>> &dropped);
+void record_telemetry(int node_id, const Message::Telemetry &telemetry);
+void run_relay();
+vector<string> messages_text{"REQUEST", "ASSIGN", "CHECKPOINT", "FOUND", "STOP", "CONTINUE", "HELLO", "HEARTBEAT", "JOB", "REVOKE", "SHRINK"};
+constexpr int PRINTABLE_RANGE = 57; // Must match the node's candidate alphabet.
+constexpr int BASE_ASCII = 48;
+constexpr int MAX_BOUNDED_LENGTH = 10;  // 57^11 overflows a long long.
 chrono::steady_clock::time_point first_node_connection_time;
+once_flag first_node_connection;
 void graceful_shutdown();
 
 void signal_handler(int signum) {
-    cout << "\nSignal (" << signum << ") received. Shutting down..." << endl;
-    shutdown_requested.store(true);
-    graceful_shutdown();
+    LOG(INFO) << "Signal (" << signum << ") received. Shutting down...";
+    shutdown_requested.store(true); // epoll_wait returns EINTR and the loop shuts down.
 }
 
+/**
+ * Same encoding as the node: least significant digit first.
+ */
 string index_to_password(long long index) {
     string password;
     while (index || password.empty()) {
-        password.insert(password.begin(), static_cast<char>((index % PRINTABLE_RANGE) + BASE_ASCII));
+        password.push_back(static_cast<char>((index % PRINTABLE_RANGE) + BASE_ASCII));
         index /= PRINTABLE_RANGE;
     }
     return password;
 }
-bool recv_message(int client_socket, Message &msg) {
-    uint32_t size_net;
-    ssize_t n = recv(client_socket, &size_net, sizeof(size_net), MSG_WAITALL);
-
-    if (n == 0) {
-        cout << "\nNode: " << client_socket << " disconnected gracefully.\n" << endl;
-        return false;
-    } else if (n < 0) {
-        cerr << "[recv_message] Error receiving message size: " << strerror(errno) << endl;
-        return false;
-    } else if (n != sizeof(size_net)) {
-        cerr << "[recv_message] Incomplete size read: " << n << " bytes." << endl;
-        return false;
-    }
-
-    uint32_t size = ntohl(size_net);
-    if (size == 0 || size > 10 * 1024 * 1024) {
-        cerr << "[recv_message] Invalid message size: " << size << endl;
-        return false;
-    }
-
-    string buffer(size, '\0');
-    n = recv(client_socket, buffer.data(), size, MSG_WAITALL);
-
-    if (n == 0) {
-        cerr << "[recv_message] Node: " << client_socket << "disconnected during payload receive." << endl;
-        return false;
-    } else if (n < 0) {
-        cerr << "[recv_message] Error receiving message payload: " << strerror(errno) << endl;
-        return false;
-    } else if (n != size) {
-        cerr << "[recv_message] Incomplete message payload received: " << n << " of " << size << " bytes." << endl;
-        return false;
-    }
-
-    try {
-        msg = Message::deserialize(buffer);
-    } catch (const std::exception &e) {
-        cerr << "[recv_message] Deserialization error: " << e.what() << endl;
+/**
+ * Writes as much of a node's queued output as the socket takes. Whatever is left
+ * goes out when epoll reports the socket writable again, so a slow reader only
+ * ever delays itself. Returns false if the connection had to be dropped.
+ */
+bool flush_output(int fd) {
+    Connection &connection = shard->connections[fd];
+    while (connection.out_sent < connection.out.size()) {
+        ssize_t sent = send(fd, connection.out.data() + connection.out_sent,
+                            connection.out.size() - connection.out_sent, MSG_NOSIGNAL);
+        if (sent > 0) {
+            connection.out_sent += sent;
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        LOG(WARN) << "[send_message] Node " << fd << ": " << strerror(errno);
+        drop_connection(fd);
         return false;
     }
+    connection.out.clear();
+    connection.out_sent = 0;
     return true;
 }
 
-
+/**
+ * Queues a length-prefixed frame for a node and starts writing it. Never blocks.
+ * Frames queued while the socket is full go out together in one send.
+ */
 bool send_message(int client_socket, const Message &msg) {
-    string serialized = msg.serialize();
-    uint32_t size = serialized.size();
-    uint32_t size_net = htonl(size);
-    if (send(client_socket, &size_net, sizeof(size_net), 0) != sizeof(size_net)) {
-        cerr << "[send_message] Failed to send message size." << endl;
+    if (client_socket < 0 || client_socket >= static_cast<int>(shard->connections.size()) || !shard->connections[client_socket].open)
+        return false;
+    Connection &connection = shard->connections[client_socket];
+    msg.append_frame(connection.out);
+    if (connection.out.size() - connection.out_sent > MAX_PENDING_OUTPUT) {
+        LOG(WARN) << "[send_message] Node " << client_socket << " is not reading its socket, dropping it.";
+        drop_connection(client_socket);
         return false;
     }
-    ssize_t total_sent = 0;
-    const char *data = serialized.c_str();
-    while (total_sent < size) {
-        ssize_t sent = send(client_socket, data + total_sent, size - total_sent, 0);
-        if (sent <= 0) {
-            cerr << "[send_message] Failed to send full message payload." << endl;
-            return false;
-        }
-        total_sent += sent;
-    }
-    return true;
+    return flush_output(client_socket);
 }
 
 const char *get_hash_type(const char *pwd_hash) {
@@ -154,192 +318,1180 @@ void extract_salt(char *hashed_pwd, char *salt_buffer, size_t buffer_size) {
     salt_buffer[salt_len] = '\0';
 }
 
+/**
+ * Tells every node on this shard to stop, then gives their sockets a bounded time to
+ * take the STOP before closing them. Nodes that don't drain in time are simply closed.
+ */
 void graceful_shutdown() {
-    cout << "Shutting down all nodes" << endl;
+    if (shard->id == 0) LOG(INFO) << "Shutting down all nodes";
 
-    lock_guard<mutex> lock(global_mutex);
-    vector<int> closed_nodes;
-    for (const auto& [active_node, _]: active_nodes) {
-        send_message(active_node, Message(Message::STOP));
-        closed_nodes.push_back(active_node);
-        cout << "Shutting down node: " << active_node << endl;
+    if (shard->listen_fd >= 0) {
+        close(shard->listen_fd);
+        shard->listen_fd = -1;
+    }
+    if (shard->unix_fd >= 0) {
+        close(shard->unix_fd);
+        unlink(unix_path.c_str());
+        shard->unix_fd = -1;
+    }
+    for (int fd = 0; fd < static_cast<int>(shard->connections.size()); ++fd) {
+        if (!shard->connections[fd].open) continue;
+        send_message(fd, Message(Message::STOP));
+        LOG(DEBUG) << "Shutting down node: " << fd;
     }
 
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(SHUTDOWN_FLUSH_MS);
+    epoll_event events[MAX_EVENTS];
+    while (chrono::steady_clock::now() < deadline) {
+        bool pending = false;
+        for (const auto &connection : shard->connections) pending |= connection.open && !connection.out.empty();
+        if (!pending) break;
+        int ready = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < ready; ++i) {
+            int fd = events[i].data.fd;
+            if (fd < static_cast<int>(shard->connections.size()) && shard->connections[fd].open && (events[i].events & EPOLLOUT))
+                flush_output(fd);
+        }
+    }
 
-    sleep(5);
+    for (int fd = 0; fd < static_cast<int>(shard->connections.size()); ++fd) {
+        drop_connection(fd);
+    }
+}
 
-    for (int node_id : closed_nodes) {
-        close(node_id);
-        FD_CLR(node_id, &read_fds);
-        active_nodes.erase(node_id);
-        node_last_seen.erase(node_id);
+/**
+ * Applies one message to the shared job state under global_mutex and sends the reply,
+ * if any, after releasing it.
+ */
+void handle_message(int client_sock, const Message &msg, long long work_size) {
+    LOG(DEBUG) << "Handling message from node: " << client_sock << ": " << messages_text[msg.type];
+    optional<Message> reply;
+    optional<Message> job_msg;
+    auto received = chrono::steady_clock::now();
+    {
+        lock_guard<mutex> lock(global_mutex);
+        switch (msg.type) {
+            case Message::REQUEST:
+                if (msg.Checkpoint_Data) release_completed(client_sock, msg.Checkpoint_Data->ranges);
+                reply = password_found.load() ? Message{Message::STOP} : assign_work(client_sock, work_size);
+                // Copied under the lock: a relay's job arrives from its parent on another thread.
+                if (reply->type == Message::ASSIGN && !shard->connections[client_sock].job_sent)
+                    job_msg = Message{Message::JOB, job};
+                break;
+            case Message::CHECKPOINT:
+                if (msg.Checkpoint_Data) release_completed(client_sock, msg.Checkpoint_Data->ranges);
+                reply = Message{password_found.load() ? Message::STOP : Message::CONTINUE};
+                break;
+            case Message::HELLO:
+                if (msg.Hello_Data) reply = handle_hello(client_sock, *msg.Hello_Data);
+                break;
+            case Message::HEARTBEAT:
+                if (msg.Telemetry_Data) record_telemetry(client_sock, *msg.Telemetry_Data);
+                break;
+            case Message::FOUND:
+                if (msg.Found_Data)
+                    handle_found(client_sock, msg.Found_Data->pwd_idx);
+                break;
+            case Message::SHRINK:
+                if (msg.Checkpoint_Data) acknowledge_split(client_sock, msg.Checkpoint_Data->ranges);
+                break;
+            default:
+                LOG(WARN) << "Unknown " << static_cast<int>(msg.type) << " type from " << client_sock;
+        }
     }
+    if (msg.type <= Message::SHRINK) message_latency[msg.type].observe(chrono::steady_clock::now() - received);
+    if (job_msg) {
+        send_message(client_sock, *job_msg);
+        shard->connections[client_sock].job_sent = true;
+    }
+    if (reply) send_message(client_sock, *reply);
+}
+/**
+ * Reads everything a node has sent, then handles each complete frame in it. A frame
+ * split across reads waits in the connection's buffer for the rest, so a node that
+ * stalls mid-message holds up nobody else.
+ */
+void read_input(int fd, long long work_size) {
+    char chunk[64 * 1024];
+    bool closed = false;
+    while (true) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n > 0) {
+            shard->connections[fd].in.append(chunk, n);
+            continue;
+        }
+        if (n == 0) {
+            LOG(INFO) << "Node: " << fd << " disconnected gracefully.";
+            closed = true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOG(WARN) << "[recv_message] Node " << fd << ": " << strerror(errno);
+            closed = true;
+        }
+        break;
+    }
+    shard->connections[fd].last_seen = chrono::steady_clock::now();
 
-    if (serv_sock >= 0) {
-        close(serv_sock);
-        serv_sock = -1;
+    size_t parsed = 0;
+    while (shard->connections[fd].open && !password_found) {
+        const string &in = shard->connections[fd].in;
+        uint32_t size_net;
+        if (in.size() - parsed < sizeof(size_net)) break;
+        memcpy(&size_net, in.data() + parsed, sizeof(size_net));
+        uint32_t size = ntohl(size_net);
+        if (size == 0 || size > MAX_FRAME_SIZE) {
+            LOG(WARN) << "[recv_message] Invalid message size from node " << fd << ": " << size;
+            drop_connection(fd);
+            return;
+        }
+        if (in.size() - parsed - sizeof(size_net) < size) break;
+        Message msg;
+        try {
+            msg = Message::deserialize(string_view(in).substr(parsed + sizeof(size_net), size));
+        } catch (const std::exception &e) {
+            LOG(WARN) << "[recv_message] Deserialization error from node " << fd << ": " << e.what();
+            drop_connection(fd);
+            return;
+        }
+        parsed += sizeof(size_net) + size;
+        handle_message(fd, msg, work_size);
     }
+    if (!shard->connections[fd].open) return;
+    shard->connections[fd].in.erase(0, parsed);
+    if (closed) drop_connection(fd);
+}
+
+/**
+ * Starts tracking a freshly accepted socket and registers it edge-triggered.
+ */
+uint64_t liveness_key(int fd) {
+    return (static_cast<uint64_t>(shard->connections[fd].generation) << 32) | static_cast<uint32_t>(fd);
+}
+
+void open_connection(int fd) {
+    if (fd >= static_cast<int>(shard->connections.size())) shard->connections.resize(max<size_t>(fd + 1, shard->connections.size() * 2));
+    Connection &connection = shard->connections[fd];
+    connection = Connection{};
+    connection.open = true;
+    connection.last_seen = chrono::steady_clock::now();
+    connection.generation = ++shard->next_generation;
+    shard->liveness.schedule(liveness_key(fd), connection.last_seen + shard->node_timeout);
+    ++connected_nodes;
+
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET; // EPOLLOUT only fires once a full send buffer drains.
+    event.data.fd = fd;
+    epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ * Accepts everything queued on a listening socket. It is edge-triggered, so one
+ * wakeup may stand for many connections and the queue must be drained to EAGAIN.
+ */
+void accept_connections(int listen_fd, Transport::Kind kind) {
+    while (true) {
+        sockaddr_storage client_addr{};
+        socklen_t client_size = sizeof(client_addr);
+        int client_sock = accept4(listen_fd, (sockaddr *) &client_addr, &client_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                LOG(WARN) << "Out of file descriptors, deferring accepts: " << strerror(errno);
+                shard->accept_pending = true;
+            }
+            return;
+        }
+        Transport::configure(client_sock, kind);
+        open_connection(client_sock);
+        LOG(INFO) << "New " << (kind == Transport::UNIX ? "local" : "remote") << " client connected. Node id: "
+             << client_sock;
 
-    if (shutdown_requested) {
-        remaining_work.clear();
+        // Track the time of the first client connection
+        call_once(first_node_connection, [] { first_node_connection_time = chrono::steady_clock::now(); });
     }
 }
 
-void handle_message(int client_sock, long long work_size) {
-    Message msg;
-    node_last_seen[client_sock] = chrono::steady_clock::now();
-    if (!recv_message(client_sock, msg)) {
-        lock_guard<mutex> lock(global_mutex);
-        reassign_remaining_work(client_sock);
-        active_nodes.erase(client_sock);
-        node_last_seen.erase(client_sock);
-        FD_CLR(client_sock, &read_fds);
-        close(client_sock);
-        return;
+void post(int shard_id, Posted posted) {
+    Shard &target = *shards[shard_id];
+    {
+        lock_guard<mutex> lock(target.inbox_mutex);
+        target.inbox.push_back(std::move(posted));
     }
-    cout << "Handling message from node: " << client_sock << ": " + messages_text[msg.type] << endl;
-    switch (msg.type) {
-        case Message::REQUEST:
-            if (password_found.load()) {
-                send_message(client_sock, Message{Message::STOP});
-            } else {
-                assign_work(client_sock, work_size);
-            }
-            break;
-        case Message::FOUND:
-            if (msg.Found_Data)
-                handle_found(client_sock, msg.Found_Data->pwd_idx);
+    uint64_t one = 1;
+    (void) !write(target.wake_fd, &one, sizeof(one));
+}
+
+/**
+ * Asks a shard to close one of its connections, if it still belongs to the session.
+ */
+void post_close(int shard_id, int fd, int session_id) {
+    post(shard_id, Posted{fd, session_id, nullopt});
+}
+
+/**
+ * Queues a message for a node on whichever shard owns it. Safe under global_mutex,
+ * since the owning shard does the send.
+ */
+void post_message(int shard_id, int fd, int session_id, const Message &msg) {
+    post(shard_id, Posted{fd, session_id, msg});
+}
+
+void wake_all_shards() {
+    uint64_t one = 1;
+    for (const auto &other : shards) (void) !write(other->wake_fd, &one, sizeof(one));
+}
+
+void drain_inbox() {
+    uint64_t count;
+    (void) !read(shard->wake_fd, &count, sizeof(count));
+    vector<Posted> posted;
+    {
+        lock_guard<mutex> lock(shard->inbox_mutex);
+        posted.swap(shard->inbox);
+    }
+    for (const auto &[fd, session_id, message] : posted) {
+        if (fd >= static_cast<int>(shard->connections.size()) || !shard->connections[fd].open || shard->connections[fd].session != session_id)
+            continue;
+        if (message) {
+            send_message(fd, *message);
+        } else {
+            drop_connection(fd);
+        }
+    }
+}
+
+bool job_over() {
+    return password_found || shutdown_requested.load() || keyspace_done.load();
+}
+
+/**
+ * Accepts on every listener the shard has. Retrying after EMFILE goes through here,
+ * since the listeners' edges have already fired.
+ */
+void accept_all() {
+    shard->accept_pending = false;
+    if (shard->listen_fd >= 0) accept_connections(shard->listen_fd, Transport::TCP);
+    if (shard->unix_fd >= 0) accept_connections(shard->unix_fd, Transport::UNIX);
+}
+
+/**
+ * Drops nodes silent for the timeout. Messages only update last_seen; when a node's
+ * timer fires and it has been heard from since, the timer moves to the new deadline.
+ * So the work is proportional to the timers that fire, not to the number of nodes.
+ */
+void expire_connections(chrono::steady_clock::time_point now) {
+    vector<uint64_t> expired;
+    shard->liveness.advance(now, expired);
+    for (uint64_t key : expired) {
+        int fd = static_cast<int>(key & 0xffffffff);
+        if (fd >= static_cast<int>(shard->connections.size())) continue;
+        const Connection &connection = shard->connections[fd];
+        if (!connection.open || connection.generation != key >> 32) continue;
+        auto deadline = connection.last_seen + shard->node_timeout;
+        if (deadline > now) {
+            shard->liveness.schedule(key, deadline);
+            continue;
+        }
+        LOG(WARN) << "Node: " << fd << " timed out";
+        drop_connection(fd);
+    }
+}
+
+/**
+ * Sessions whose node didn't come back within the grace period lose their leases.
+ * A session that reconnected, or disconnected again later, ignores the stale timer.
+ */
+void expire_sessions(chrono::steady_clock::time_point now) {
+    lock_guard<mutex> lock(global_mutex);
+    vector<uint64_t> expired;
+    session_expiry.advance(now, expired);
+    for (uint64_t key : expired) {
+        auto it = sessions.find(static_cast<int>(key));
+        if (it == sessions.end() || it->second.fd >= 0 || now - it->second.disconnected_at < chrono::seconds(grace_seconds))
+            continue;
+        LOG(INFO) << "Session " << it->first << " expired";
+        reassign_remaining_work(it->first);
+        session_tokens.erase(it->second.token);
+        sessions.erase(it);
+    }
+}
+
+/**
+ * Event loop of one shard. Shard 0 also does the job-wide housekeeping: journal sync
+ * and session expiry.
+ */
+void run_shard(Shard &self, long long work_size, int timeout_seconds) {
+    shard = &self;
+    shard->node_timeout = chrono::seconds(timeout_seconds);
+    epoll_event events[MAX_EVENTS];
+    while (!job_over()) {
+        {
+            lock_guard<mutex> lock(global_mutex);
+            // A relay's ledger runs dry between grants; only its parent knows when the job is done.
+            if (!relay_mode && ledger.exhausted() && !keyspace_done.exchange(true))
+                LOG(INFO) << "Keyspace exhausted. Password not found.";
+        }
+        if (keyspace_done) break;
+        // Wake at least every second to sync the journal.
+        int ready = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, min(timeout_seconds, 1) * 1000);
+        if (ready < 0 && errno != EINTR) {
+            LOG(ERROR) << "epoll_wait failed: " << strerror(errno);
             break;
-        default:
-            cout << "Unknown " << msg.type << " type from " << client_sock << endl;
-    }
-}
-void start_server(int port, long long work_size, int timeout_seconds) {
-    serv_sock = socket(AF_INET6, SOCK_STREAM, 0);
-    if (serv_sock < 0) {
-        cerr << "Socket creation failed.\n";
-        exit(1);
-    }
-    int opt = 0;
-    setsockopt(serv_sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
-    sockaddr_in6 server_addr{};
-    server_addr.sin6_family = AF_INET6;
-    server_addr.sin6_port = htons(port);
-    server_addr.sin6_addr = in6addr_any;
-    if (bind(serv_sock, (sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
-        cerr << "Bind failed.\n";
-        exit(1);
-    }
-
-    listen(serv_sock, MAX_CLIENTS);
-    FD_ZERO(&read_fds);
-    FD_SET(serv_sock, &read_fds);
-    max_fd = serv_sock;
-    cout << "Server started on port: " << port << endl;
-
-    while (!password_found && !shutdown_requested.load()) {
-        fd_set temp_fds = read_fds;
-        timeval tv{.tv_sec = timeout_seconds, .tv_usec = 0};
-        int activity = select(max_fd + 1, &temp_fds, nullptr, nullptr, &tv);
-        if (activity < 0) continue;
-        for (int fd = 0; fd <= max_fd; ++fd) {
-            if (!FD_ISSET(fd, &temp_fds)) continue;
-            if (fd == serv_sock) {
-                sockaddr_in6 client_addr{};
-                socklen_t client_size = sizeof(client_addr);
-                int client_sock = accept(serv_sock, (sockaddr *) &client_addr, &client_size);
-                if (client_sock < 0) continue;
-                FD_SET(client_sock, &read_fds);
-                if (client_sock > max_fd) max_fd = client_sock;
-
-                cout << "New client connected. Node id: " << client_sock << endl;
-
-                // Track the time of the first client connection
-                if (first_node_connection_time == chrono::steady_clock::time_point()) {
-                    first_node_connection_time = chrono::steady_clock::now();
-                }
-            } else {
-                handle_message(fd, work_size);
+        }
+        for (int i = 0; i < ready; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == shard->listen_fd || fd == shard->unix_fd) {
+                accept_connections(fd, fd == shard->unix_fd ? Transport::UNIX : Transport::TCP);
+                continue;
             }
+            if (fd == shard->wake_fd) {
+                drain_inbox();
+                continue;
+            }
+            // An earlier event in this batch may have dropped the connection.
+            if (fd >= static_cast<int>(shard->connections.size()) || !shard->connections[fd].open) continue;
+            if (events[i].events & EPOLLOUT) flush_output(fd);
+            if (shard->connections[fd].open && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                read_input(fd, work_size);
+        }
+        if (shard->accept_pending) accept_all();
+
+        if (journal && shard->id == 0) {
+            lock_guard<mutex> lock(global_mutex);
+            journal->flush();
+            if (journal->compaction_due()) journal->compact(ledger);
         }
 
-        // Handle disconnections (timeouts)
         auto now = chrono::steady_clock::now();
+        expire_connections(now);
+        if (shard->id == 0) expire_sessions(now);
+    }
+    wake_all_shards();
+    graceful_shutdown();
+}
+
+/**
+ * Runs the controller on io_threads shards until the job is over.
+ */
+void start_server(int port, long long work_size, int timeout_seconds, int io_threads) {
+    for (int i = 0; i < io_threads; ++i) {
+        auto next = make_unique<Shard>();
+        next->id = i;
+        next->listen_fd = Transport::listen_tcp(port, LISTEN_BACKLOG);
+        if (next->listen_fd < 0) exit(1);
+        if (i == 0 && !unix_path.empty()) {
+            next->unix_fd = Transport::listen_unix(unix_path, LISTEN_BACKLOG);
+            if (next->unix_fd < 0) exit(1);
+        }
+        next->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        next->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (next->epoll_fd < 0 || next->wake_fd < 0) {
+            LOG(ERROR) << "Shard setup failed: " << strerror(errno);
+            exit(1);
+        }
+        for (int fd : {next->listen_fd, next->unix_fd, next->wake_fd}) {
+            if (fd < 0) continue;
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLET;
+            event.data.fd = fd;
+            epoll_ctl(next->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        }
+        shards.push_back(move(next));
+    }
+    LOG(INFO) << "Server started on port: " << port << " with " << io_threads << " I/O threads";
+    if (!unix_path.empty()) LOG(INFO) << "Local nodes can connect on unix:" << unix_path;
+
+    // Started once the shards exist, since it wakes them when the parent stops or is lost.
+    thread relay;
+    if (relay_mode) {
+        LOG(INFO) << "Relaying for " << Transport::describe(parent);
+        relay = thread(run_relay);
+    }
+    vector<thread> threads;
+    for (int i = 1; i < io_threads; ++i) threads.emplace_back(run_shard, ref(*shards[i]), work_size, timeout_seconds);
+    run_shard(*shards[0], work_size, timeout_seconds);
+    for (auto &t : threads) t.join();
+    if (relay.joinable()) {
+        relay_done = true;
+        relay.join();
+    }
+    for (const auto &done : shards) {
+        close(done->epoll_fd);
+        close(done->wake_fd);
+    }
+}
+
+/**
+ * Returns whatever a departed node still held to the free pool. Ranges it reported
+ * in checkpoints are already marked done, so only the unfinished parts come back.
+ */
+void reassign_remaining_work(int session_id) {
+    auto leases = ledger.leases(session_id);
+    for (const auto &lease : leases) {
+        LOG(INFO) << "Returning range from session " << session_id << ": "
+             << lease.range.first << "-" << lease.range.second;
+    }
+    ledger.release(session_id);
+    erase_if(speculations, [session_id](const Speculation &spec) { return spec.backup == session_id; });
+    pending_splits.erase(session_id);
+}
+
+/**
+ * Session of a connected node, created on first use.
+ */
+int session_of(int fd) {
+    Connection &connection = shard->connections[fd];
+    if (connection.session >= 0) return connection.session;
+    int id = next_session_id++;
+    unsigned long long token;
+    do token = token_rng(); while (token == 0 || session_tokens.count(token));
+    sessions[id] = Session{token, fd, shard->id, {}};
+    session_tokens[token] = id;
+    connection.session = id;
+    return id;
+}
+
+/**
+ * Closes a node's socket and forgets its per-connection state. Its session keeps
+ * the leases until the grace period runs out, or it resumes on a new connection.
+ */
+void drop_connection(int fd) {
+    if (fd < 0 || fd >= static_cast<int>(shard->connections.size()) || !shard->connections[fd].open) return;
+    close(fd); // Also removes it from the epoll set.
+    Connection &connection = shard->connections[fd];
+    --connected_nodes;
+    {
         lock_guard<mutex> lock(global_mutex);
-        for (auto it = node_last_seen.begin(); it != node_last_seen.end();) {
-            int node_id = it->first;
-            auto last_seen = it->second;
-            if (chrono::duration_cast<chrono::seconds>(now - last_seen).count() > timeout_seconds) {
-                cerr << "Node: " << node_id << " timed out\n";
-                close(node_id);
-                FD_CLR(node_id, &read_fds);  // Remove from FD_SET
-                reassign_remaining_work(node_id);
-                active_nodes.erase(node_id);
-                node_last_seen.erase(it);
-            } else {
-                ++it;
-            }
+        cluster_rate = max(0.0, cluster_rate - connection.stats.hash_rate);
+        pending_splits.erase(connection.session); // Its acknowledgement won't come.
+        auto it = sessions.find(connection.session);
+        // A session that already moved to a newer connection is left alone.
+        if (it != sessions.end() && it->second.fd == fd && it->second.shard == shard->id) {
+            it->second.fd = -1;
+            it->second.disconnected_at = chrono::steady_clock::now();
+            session_expiry.schedule(it->first, it->second.disconnected_at + chrono::seconds(grace_seconds));
+        }
+    }
+    connection = Connection{};
+}
+
+/**
+ * Binds a (re)connecting node to its session. A known token resumes the old session
+ * and its leases; otherwise a new session starts. Either way the ranges the node says
+ * it is still working on are claimed for it where nobody else has taken them, which
+ * also covers a controller that restarted from its journal. The reply carries the
+ * token to present next time and the leases the controller holds for the node.
+ */
+Message handle_hello(int fd, const Message::Hello &hello) {
+    shard->connections[fd].placement = hello.placement;
+    LOG(INFO) << "Node " << fd << " running " << hello.threads << " threads, " << hello.placement;
+
+    int id;
+    auto known = session_tokens.find(hello.session);
+    if (hello.session != 0 && known != session_tokens.end()) {
+        id = known->second;
+        Session &session = sessions[id];
+        if (session.fd >= 0 && (session.fd != fd || session.shard != shard->id))
+            post_close(session.shard, session.fd, id); // Half-open old connection.
+        int previous = shard->connections[fd].session;
+        if (previous >= 0 && previous != id) {
+            reassign_remaining_work(previous);
+            session_tokens.erase(sessions[previous].token);
+            sessions.erase(previous);
+        }
+        session.fd = fd;
+        session.shard = shard->id;
+        shard->connections[fd].session = id;
+        LOG(INFO) << "Node " << fd << " resumed session " << id;
+        // What the node no longer presents went with the old connection, in an unread
+        // ASSIGN or a lost REQUEST's finished units. Nobody would ever report it.
+        ledger.retain(id, hello.leases);
+        erase_if(speculations, [id, &hello](const Speculation &spec) {
+            return spec.backup == id && none_of(hello.leases.begin(), hello.leases.end(), [&spec](const auto &range) {
+                return range.first <= spec.range.second && spec.range.first <= range.second;
+            });
+        });
+    } else {
+        id = session_of(fd);
+    }
+
+    for (const auto &[start, end] : hello.leases) {
+        ledger.claim(id, start, end);
+    }
+    Message::Hello reply{fd, 0, sessions[id].token, {}, ""};
+    for (const auto &lease : ledger.leases(id)) reply.leases.push_back(lease.range);
+    return Message{Message::HELLO, reply};
+}
+
+/**
+ * Tells a session's node to stop searching ranges: REVOKE for ranges someone else
+ * finished, SHRINK for a tail handed to another node.
+ * @return false if the node isn't connected.
+ */
+bool revoke(int session_id, const vector<pair<long long, long long>> &ranges, Message::MessageType type = Message::REVOKE) {
+    auto it = sessions.find(session_id);
+    if (it == sessions.end() || it->second.fd < 0) return false;
+    post_message(it->second.shard, it->second.fd, session_id, Message{type, Message::Checkpoint{it->second.fd, ranges}});
+    return true;
+}
+
+/**
+ * Settles the endgame races a newly searched range decides: whoever else is still
+ * on it is told to drop it, and a holder its duplicate beat takes a strike.
+ */
+void settle_speculations(int reporter, long long start, long long end) {
+    vector<Speculation> undecided;
+    for (auto spec : speculations) {
+        auto [first, last] = spec.range;
+        if (last < start || first > end) {
+            undecided.push_back(spec);
+            continue;
+        }
+        long long from = max(first, start), to = min(last, end);
+        if (spec.backup != reporter) revoke(spec.backup, {{from, to}});
+        for (const auto &lease : ledger.leased_within(from, to)) {
+            if (lease.owner == reporter) continue;
+            revoke(lease.owner, {lease.range});
+            if (reporter != spec.backup || spec.decided) continue;
+            spec.decided = true;
+            auto loser = sessions.find(lease.owner);
+            if (loser != sessions.end() && ++loser->second.races_lost == SLOW_NODE_STRIKES)
+                LOG(INFO) << "Session " << lease.owner << " flagged slow: lost " << SLOW_NODE_STRIKES
+                     << " endgame races to duplicates";
         }
+        if (first < from) undecided.push_back({{first, from - 1}, spec.backup, spec.decided});
+        if (to < last) undecided.push_back({{to + 1, last}, spec.backup, spec.decided});
     }
-    close(serv_sock);
+    speculations.swap(undecided);
 }
 
-void reassign_remaining_work(int client_sock) {
-    if (active_nodes.count(client_sock)) {
-        remaining_work.push_back(active_nodes[client_sock]);
+/**
+ * Nothing is free, so an idle node takes the back half of the largest lease another
+ * node holds. It is leased to the idle node straight away and the holder is sent a
+ * SHRINK; batches the holder had already claimed past the cut get searched twice.
+ */
+optional<pair<long long, long long>> split_largest_lease(int session_id) {
+    auto size = [](const WorkLedger::Lease &lease) { return lease.range.second - lease.range.first + 1; };
+    optional<WorkLedger::Lease> pick;
+    for (const auto &lease : ledger.leased_within(0, ledger.frontier() - 1)) {
+        if (lease.owner == session_id || pending_splits.count(lease.owner)) continue;
+        // A holder in its grace period can't be sent the SHRINK and would resume the whole unit.
+        auto owner = sessions.find(lease.owner);
+        if (owner == sessions.end() || owner->second.fd < 0) continue;
+        bool duplicated = any_of(speculations.begin(), speculations.end(), [&lease](const Speculation &spec) {
+            return spec.range.first <= lease.range.second && lease.range.first <= spec.range.second;
+        });
+        if (!duplicated && (!pick || size(lease) > size(*pick))) pick = lease;
     }
+    if (!pick || size(*pick) < 2 * MIN_SPLIT) return nullopt;
+
+    pair<long long, long long> tail{pick->range.first + size(*pick) / 2, pick->range.second};
+    ledger.transfer(session_id, tail.first, tail.second);
+    revoke(pick->owner, {tail}, Message::SHRINK);
+    pending_splits[pick->owner] = tail;
+    LOG(INFO) << "Split " << pick->range.first << "-" << pick->range.second << " of session " << pick->owner
+         << ": " << tail.first << "-" << tail.second << " to session " << session_id;
+    return tail;
+}
+
+/**
+ * A node confirmed the part of a split tail it gave up. Anything it kept was already
+ * claimed by its workers and is being searched by both nodes.
+ */
+void acknowledge_split(int node_id, const vector<pair<long long, long long>> &dropped) {
+    auto it = pending_splits.find(session_of(node_id));
+    if (it == pending_splits.end()) return;
+    auto [start, end] = it->second;
+    long long kept = end - start + 1;
+    for (const auto &[from, to] : dropped) kept -= max(0LL, min(to, end) - max(from, start) + 1);
+    candidates_overlapped += kept;
+    LOG(INFO) << "Node " << node_id << " shrank its lease to end before " << start << ", " << kept
+         << " candidates past the cut were already claimed";
+    pending_splits.erase(it);
+}
+
+/**
+ * Endgame: nothing is free, so an idle node duplicates the oldest lease another node
+ * holds, taking those of nodes flagged slow first. Each range gets one duplicate.
+ */
+optional<pair<long long, long long>> speculate(int session_id) {
+    auto rank = [](const WorkLedger::Lease &lease) {
+        auto owner = sessions.find(lease.owner);
+        bool slow = owner != sessions.end() && owner->second.races_lost >= SLOW_NODE_STRIKES;
+        return pair{!slow, lease.since};
+    };
+    optional<WorkLedger::Lease> pick;
+    for (const auto &lease : ledger.leased_within(0, ledger.frontier() - 1)) {
+        if (lease.owner == session_id) continue;
+        bool duplicated = any_of(speculations.begin(), speculations.end(), [&lease](const Speculation &spec) {
+            return spec.range.first <= lease.range.second && lease.range.first <= spec.range.second;
+        });
+        if (!duplicated && (!pick || rank(lease) < rank(*pick))) pick = lease;
+    }
+    if (!pick) return nullopt;
+    speculations.push_back({pick->range, session_id});
+    candidates_duplicated += pick->range.second - pick->range.first + 1;
+    LOG(INFO) << "Endgame: duplicating " << pick->range.first << "-" << pick->range.second << " held by session "
+         << pick->owner << " for session " << session_id;
+    return pick->range;
+}
+
+/**
+ * Marks ranges a node reported as searched, from CHECKPOINT sub-ranges or whole
+ * units piggybacked on REQUEST. A lease that is only partly done is split.
+ */
+void release_completed(int node_id, const vector<pair<long long, long long>> &completed) {
+    for (const auto &[start, end] : completed) {
+        if (!speculations.empty()) settle_speculations(session_of(node_id), start, end);
+        ledger.complete(start, end);
+        if (journal) journal->completed(start, end);
+        if (relay_mode) upstream_done.emplace_back(start, end);
+    }
+}
+
+void record_telemetry(int node_id, const Message::Telemetry &telemetry) {
+    auto now = chrono::steady_clock::now();
+    NodeStats &stats = shard->connections[node_id].stats;
+    double previous_rate = stats.hash_rate;
+    if (stats.updated != chrono::steady_clock::time_point()) {
+        double elapsed_ms = chrono::duration<double, milli>(now - stats.updated).count();
+        size_t threads = max<size_t>(1, telemetry.thread_rates.size());
+        if (elapsed_ms > 0) {
+            stats.idle_fraction = static_cast<double>(telemetry.idle_ms - stats.idle_ms) / (elapsed_ms * threads);
+            stats.io_fraction = static_cast<double>(telemetry.io_ms - stats.io_ms) / elapsed_ms;
+        }
+    }
+    cluster_tested += max(0LL, telemetry.tested - stats.tested);
+    stats.thread_rates = telemetry.thread_rates;
+    stats.hash_rate = 0;
+    for (double rate : telemetry.thread_rates) stats.hash_rate += rate;
+    stats.tested = telemetry.tested;
+    stats.idle_ms = telemetry.idle_ms;
+    stats.io_ms = telemetry.io_ms;
+    stats.updated = now;
+    cluster_rate = max(0.0, cluster_rate + stats.hash_rate - previous_rate);
+    sessions[session_of(node_id)].hash_rate = stats.hash_rate;
+
+    LOG(DEBUG) << "Node " << node_id << ": " << static_cast<long long>(stats.hash_rate) << " hashes/s, idle "
+         << static_cast<int>(stats.idle_fraction * 100) << "%, io " << static_cast<int>(stats.io_fraction * 100)
+         << "%. Cluster: " << static_cast<long long>(cluster_rate) << " hashes/s, searched "
+         << ledger.coverage() * 100 << "% in " << ledger.fragments() << " fragments";
 }
 
 void handle_found(int node_id, long long pwd_idx) {
-    lock_guard<mutex> lock(global_mutex);
     if (!password_found.exchange(true)) {
+        found_index = pwd_idx;
         correct_password = index_to_password(pwd_idx);
-        cout << "PASSWORD FOUND BY NODE " << node_id << ": " << correct_password << endl;
+        LOG(INFO) << "PASSWORD FOUND BY NODE " << node_id << ": " << correct_password;
 
         auto end_time = chrono::steady_clock::now();
         auto duration = chrono::duration_cast<chrono::seconds>(end_time - first_node_connection_time).count();
-        cout << "Time taken to find password after first node connected: " << duration << " seconds." << endl;
+        LOG(INFO) << "Time taken to find password after first node connected: " << duration << " seconds.";
+
+        // Every shard's loop exits on password_found and graceful_shutdown sends STOP to its nodes.
+        wake_all_shards();
+    }
+}
 
-        Message stop_msg(Message::STOP);
-        send_message(node_id, stop_msg);
 
+/**
+ * Sizes the next unit for a node. With --unit-seconds the unit is the node's
+ * measured hash rate times the target time, falling back to work_size until the
+ * first heartbeat. On a bounded keyspace the unit is capped at half the node's
+ * share of what is left, so units shrink toward the end and nodes finish together.
+ */
+long long unit_size_for(int node_id, long long work_size) {
+    double rate = shard->connections[node_id].stats.hash_rate;
 
-        close(node_id);
-        FD_CLR(node_id, &read_fds);
+    long long size = work_size;
+    if (unit_seconds > 0 && rate > 0) size = llround(rate * static_cast<double>(unit_seconds));
 
-        // Send STOP message to all other clients
-        for (int fd = 0; fd <= max_fd; ++fd) {
-            if (FD_ISSET(fd, &read_fds) && fd != serv_sock) {
-                send_message(fd, Message(Message::STOP));
-                close(fd);
+    if (ledger.bounded()) {
+        long long remaining = ledger.available();
+        double share = (rate > 0 && cluster_rate > 0) ? rate / cluster_rate
+                                                       : 1.0 / static_cast<double>(max<size_t>(1, connected_nodes));
+        long long taper = llround(static_cast<double>(remaining) * share / 2);
+        long long min_size = max(1LL, llround(rate)); // Never below about a second of work.
+        size = min(size, max(taper, min_size));
+    }
+    return max(1LL, size);
+}
+
+/**
+ * Units a node should hold at once: window_seconds of work at its measured rate, so
+ * a fast node gets several units per ASSIGN and asks proportionally less often.
+ */
+size_t lease_window_for(int node_id, long long unit_size) {
+    double rate = shard->connections[node_id].stats.hash_rate;
+    if (window_seconds <= 0) return 1;
+    if (rate <= 0) return DEFAULT_LEASE_WINDOW;
+    long long units = llround(rate * static_cast<double>(window_seconds) / static_cast<double>(unit_size));
+    return static_cast<size_t>(clamp(units, 1LL, static_cast<long long>(MAX_LEASE_WINDOW)));
+}
+
+/**
+ * Tops a node's lease window back up. Candidates it already holds, leased or as
+ * endgame duplicates, count against window units of the current size, but a node
+ * that asks always gets at least one unit if any is free.
+ */
+Message assign_work(int node_id, long long work_size) {
+    int session_id = session_of(node_id);
+    long long held = ledger.held(session_id);
+    for (const auto &spec : speculations) {
+        if (spec.backup == session_id) held += spec.range.second - spec.range.first + 1;
+    }
+    long long size = unit_size_for(node_id, work_size);
+    long long target = static_cast<long long>(lease_window_for(node_id, size)) * size;
+    size_t wanted = held < target ? static_cast<size_t>((target - held + size - 1) / size) : 1;
+
+    Message::Assign assign{node_id, job.job_id, {}};
+    while (assign.ranges.size() < wanted) {
+        bool reused = false;
+        auto range = ledger.lease(session_id, size, &reused);
+        if (!range) break;
+        if (journal && !reused) journal->assigned(range->first, range->second);
+        // Everything a relay's parent grants arrives free below the frontier and looks reused.
+        if (reused && !relay_mode) candidates_reassigned += range->second - range->first + 1;
+        LOG(DEBUG) << (reused ? "Reassigning range from remaining work: " : "Assigning new range: ")
+             << range->first << "-" << range->second;
+        assign.ranges.push_back(*range);
+        size = unit_size_for(node_id, work_size); // Shrinks as a bounded keyspace runs out.
+    }
+    if (assign.ranges.empty() && held == 0) {
+        // A late joiner first takes half of someone's lease; on a bounded job it falls back to a duplicate.
+        auto range = split_largest_lease(session_id);
+        if (!range && ledger.bounded() && !relay_mode) range = speculate(session_id);
+        if (range) assign.ranges.push_back(*range);
+    }
+    if (assign.ranges.empty()) {
+        // Nothing free right now; the node keeps its current leases and asks again later.
+        LOG(DEBUG) << "No work left for node: " << node_id;
+        return Message{Message::CONTINUE};
+    }
+    ranges_assigned += assign.ranges.size();
+    for (const auto &[start, end] : assign.ranges) candidates_assigned += end - start + 1;
+    shard->connections[node_id].last_seen = std::chrono::steady_clock::now();
+    return Message{Message::ASSIGN, assign};
+}
+
+// RELAY MODE
+//
+// With --relay the controller leases work from a parent controller instead of owning
+// the keyspace. To the parent it is one big node; to its own nodes it is an ordinary
+// controller whose ledger holds only what the parent granted. Everything parent-facing
+// runs on one thread with a blocking socket, apart from the shards.
+
+/**
+ * Sends one frame to the parent. Only the relay thread writes to the parent socket.
+ * Searched ranges a failed REQUEST or CHECKPOINT carried go back to upstream_done.
+ */
+bool send_parent(const Message &msg) {
+    string frame;
+    msg.append_frame(frame);
+    size_t total_sent = 0;
+    while (total_sent < frame.size()) {
+        ssize_t sent = send(parent_fd, frame.data() + total_sent, frame.size() - total_sent, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) {
+            if ((msg.type == Message::REQUEST || msg.type == Message::CHECKPOINT) && msg.Checkpoint_Data) {
+                const auto &done = msg.Checkpoint_Data->ranges;
+                lock_guard<mutex> lock(global_mutex);
+                upstream_done.insert(upstream_done.end(), done.begin(), done.end());
             }
+            return false;
         }
+        total_sent += sent;
+    }
+    if (msg.type == Message::REQUEST || msg.type == Message::CHECKPOINT) {
+        parent_awaiting.push_back({msg.type, {}});
+        if (msg.Checkpoint_Data) parent_awaiting.back().done = msg.Checkpoint_Data->ranges;
     }
+    return true;
 }
 
+/**
+ * Reads what the parent has sent and parses every complete frame in it.
+ * @return false if the parent went away or sent something unparseable.
+ */
+bool recv_parent(vector<Message> &msgs) {
+    char chunk[16 * 1024];
+    ssize_t received = recv(parent_fd, chunk, sizeof(chunk), 0);
+    if (received <= 0) return false;
+    parent_buffer.append(chunk, received);
+    size_t parsed = 0;
+    while (parent_buffer.size() - parsed >= sizeof(uint32_t)) {
+        uint32_t size_net;
+        memcpy(&size_net, parent_buffer.data() + parsed, sizeof(size_net));
+        uint32_t size = ntohl(size_net);
+        if (size == 0 || size > MAX_FRAME_SIZE) {
+            LOG(WARN) << "[relay] Invalid message size from parent: " << size;
+            return false;
+        }
+        if (parent_buffer.size() - parsed - sizeof(size_net) < size) break;
+        try {
+            msgs.push_back(Message::deserialize(string_view(parent_buffer).substr(parsed + sizeof(size_net), size)));
+        } catch (const std::exception &e) {
+            LOG(WARN) << "[relay] Deserialization error from parent: " << e.what();
+            return false;
+        }
+        parsed += sizeof(size_net) + size;
+    }
+    parent_buffer.erase(0, parsed);
+    return true;
+}
 
-void assign_work(int node_id, long long work_size) {
-    pair<long long, long long> range;
-    if (!remaining_work.empty()) {
-        range = remaining_work.back();
-        remaining_work.pop_back();
-        cout << "Reassigning range from remaining work: "
-             << range.first << "-" << range.second << endl;
-    } else {
-        long long start = next_range_start.fetch_add(work_size);
-        range = {start, start + work_size - 1};
-        cout << "Assigning new range: " << range.first << "-" << range.second << endl;
+/**
+ * Connects to the parent and says HELLO. After a reconnect the HELLO carries the
+ * session token and every range the relay still holds, so the parent keeps them leased.
+ * That includes searched ranges the parent never acknowledged, which go out again with
+ * the next REQUEST or CHECKPOINT.
+ */
+bool connect_parent() {
+    parent_fd = Transport::connect_to(parent);
+    if (parent_fd < 0) return false;
+    parent_buffer.clear();
+    Message::Hello hello{0, static_cast<int>(connected_nodes.load()), parent_session, {}, "relay"};
+    {
+        lock_guard<mutex> lock(global_mutex);
+        for (const auto &awaiting : parent_awaiting)
+            upstream_done.insert(upstream_done.end(), awaiting.done.begin(), awaiting.done.end());
+        parent_awaiting.clear();
+        for (auto state : {WorkLedger::FREE, WorkLedger::LEASED}) {
+            for (const auto &range : ledger.ranges(state)) hello.leases.push_back(range);
+        }
+        hello.leases.insert(hello.leases.end(), upstream_done.begin(), upstream_done.end());
+    }
+    LOG(INFO) << "[relay] Connected to parent " << Transport::describe(parent);
+    return send_parent(Message{Message::HELLO, hello});
+}
+
+/**
+ * Retries the parent with exponential backoff for up to RELAY_RECONNECT_SECONDS.
+ * Local nodes keep working on what the relay already holds in the meantime.
+ */
+bool reconnect_parent() {
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(RELAY_RECONNECT_SECONDS);
+    auto backoff = chrono::milliseconds(100);
+    while (!relay_done && chrono::steady_clock::now() < deadline) {
+        if (connect_parent()) return true;
+        this_thread::sleep_for(backoff);
+        backoff = min(backoff * 2, chrono::milliseconds(5000));
+    }
+    return false;
+}
+
+void handle_parent_message(const Message &msg, chrono::steady_clock::time_point &next_request_at) {
+    Message::MessageType replied_to = Message::CHECKPOINT;
+    if ((msg.type == Message::ASSIGN || msg.type == Message::CONTINUE) && !parent_awaiting.empty()) {
+        replied_to = parent_awaiting.front().type;
+        parent_awaiting.pop_front();
+    }
+    switch (msg.type) {
+        case Message::HELLO:
+            if (msg.Hello_Data) parent_session = msg.Hello_Data->session;
+            break;
+        case Message::JOB:
+            if (msg.Job_Data) {
+                lock_guard<mutex> lock(global_mutex);
+                job = *msg.Job_Data;
+                LOG(INFO) << "[relay] Job " << job.job_id << ": " << job.hashed_password;
+            }
+            break;
+        case Message::ASSIGN:
+            if (msg.Assign_Data) {
+                lock_guard<mutex> lock(global_mutex);
+                for (const auto &[start, end] : msg.Assign_Data->ranges) {
+                    ledger.grant(start, end);
+                    LOG(DEBUG) << "[relay] Leased " << start << "-" << end << " from parent";
+                }
+            }
+            break;
+        case Message::REVOKE:
+            // The parent's duplicate got there first: drop it locally as well.
+            if (msg.Checkpoint_Data) {
+                lock_guard<mutex> lock(global_mutex);
+                for (const auto &[start, end] : msg.Checkpoint_Data->ranges) {
+                    for (const auto &lease : ledger.leased_within(start, end)) revoke(lease.owner, {lease.range});
+                    ledger.complete(start, end);
+                }
+            }
+            break;
+        case Message::SHRINK:
+            // Give back the part nobody here has started; ranges local nodes hold are kept.
+            if (msg.Checkpoint_Data) {
+                vector<pair<long long, long long>> dropped;
+                {
+                    lock_guard<mutex> lock(global_mutex);
+                    for (const auto &[start, end] : msg.Checkpoint_Data->ranges) {
+                        for (const auto &[first, last] : ledger.ranges(WorkLedger::FREE)) {
+                            if (last < start || first > end) continue;
+                            dropped.emplace_back(max(first, start), min(last, end));
+                        }
+                    }
+                    for (const auto &[start, end] : dropped) ledger.complete(start, end); // No longer ours to search.
+                }
+                send_parent(Message{Message::SHRINK, Message::Checkpoint{0, dropped}});
+            }
+            break;
+        case Message::CONTINUE:
+            if (replied_to == Message::REQUEST) next_request_at = chrono::steady_clock::now() + chrono::seconds(1);
+            break;
+        case Message::STOP:
+            LOG(INFO) << "[relay] Parent sent STOP";
+            parent_stopped = true;
+            shutdown_requested.store(true);
+            wake_all_shards();
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Reconnects after the parent connection failed, or shuts the relay down if the parent
+ * stays away.
+ */
+bool recover_parent() {
+    LOG(WARN) << "[relay] Lost the parent, reconnecting";
+    close(parent_fd);
+    if (reconnect_parent()) return true;
+    parent_fd = -1;
+    shutdown_requested.store(true);
+    wake_all_shards();
+    return false;
+}
+
+/**
+ * Index of the found password. handle_found raises password_found before it stores the
+ * index, so another thread that saw the flag reads the index under the lock it holds.
+ */
+long long found_password_index() {
+    lock_guard<mutex> lock(global_mutex);
+    return found_index;
+}
+
+/**
+ * The relay thread. Asks the parent for more whenever the local stock falls below
+ * window_seconds of the local nodes' combined rate, reports their finished ranges
+ * with each REQUEST and every checkpoint_interval, sends their summed rate as its
+ * heartbeat, and forwards a FOUND.
+ */
+void run_relay() {
+    auto last_checkpoint = chrono::steady_clock::now();
+    auto last_heartbeat = last_checkpoint;
+    chrono::steady_clock::time_point next_request_at;
+    bool found_sent = false;
+    if (!connect_parent() && !reconnect_parent()) {
+        LOG(ERROR) << "[relay] Could not reach parent " << Transport::describe(parent);
+        shutdown_requested.store(true);
+        wake_all_shards();
+        return;
+    }
+    while (!relay_done && !parent_stopped) {
+        pollfd readable{parent_fd, POLLIN, 0};
+        if (poll(&readable, 1, 100) > 0) {
+            vector<Message> msgs;
+            if (!recv_parent(msgs)) {
+                if (!recover_parent()) break;
+                continue;
+            }
+            for (const auto &msg : msgs) handle_parent_message(msg, next_request_at);
+        }
+
+        if (password_found && !found_sent) {
+            found_sent = send_parent(Message{Message::FOUND, Message::Found{0, found_password_index()}});
+            if (!found_sent && !recover_parent()) break;
+            continue;
+        }
+        auto now = chrono::steady_clock::now();
+        vector<pair<long long, long long>> done;
+        bool want_work = false;
+        double rate;
+        long long tested;
+        {
+            lock_guard<mutex> lock(global_mutex);
+            rate = cluster_rate;
+            tested = cluster_tested;
+            double stock = max(1.0, rate * static_cast<double>(window_seconds));
+            want_work = connected_nodes > 0 && static_cast<double>(ledger.available()) < stock;
+            bool requesting = want_work && now >= next_request_at
+                    && none_of(parent_awaiting.begin(), parent_awaiting.end(),
+                               [](const Awaiting &awaiting) { return awaiting.type == Message::REQUEST; });
+            if (requesting || now - last_checkpoint >= chrono::seconds(max(1LL, checkpoint_interval))) {
+                done.swap(upstream_done);
+            }
+            want_work = requesting;
+        }
+        bool sent = true;
+        if (want_work) {
+            Message request(Message::REQUEST);
+            if (!done.empty()) request.Checkpoint_Data = Message::Checkpoint{0, done};
+            sent = send_parent(request);
+            done.clear();
+        }
+        if (sent && (!done.empty() || now - last_checkpoint >= chrono::seconds(max(1LL, checkpoint_interval)))) {
+            if (!done.empty()) sent = send_parent(Message{Message::CHECKPOINT, Message::Checkpoint{0, done}});
+            last_checkpoint = now;
+        }
+        if (sent && now - last_heartbeat >= chrono::seconds(RELAY_HEARTBEAT_SECONDS)) {
+            sent = send_parent(Message{Message::HEARTBEAT, Message::Telemetry{0, tested, 0, 0, {rate}}});
+            last_heartbeat = now;
+        }
+        if (!sent && !recover_parent()) break;
+    }
+    if (parent_fd < 0) return;
+    if (password_found && !found_sent) send_parent(Message{Message::FOUND, Message::Found{0, found_password_index()}});
+    if (!parent_stopped) {
+        // Hand in what the local nodes finished so the parent doesn't give it out again.
+        vector<pair<long long, long long>> done;
+        {
+            lock_guard<mutex> lock(global_mutex);
+            done.swap(upstream_done);
+        }
+        if (!done.empty()) send_parent(Message{Message::CHECKPOINT, Message::Checkpoint{0, done}});
+    }
+    close(parent_fd);
+}
+
+// METRICS
+//
+// With --metrics the controller serves Prometheus text on a TCP port or a Unix socket
+// from its own thread. A scrape copies the shared totals under global_mutex and formats
+// them after releasing it; everything else is an atomic, so scraping under full load
+// costs the shards one short lock per scrape.
+
+/**
+ * Records how much is searched, once a second, for the ETA.
+ */
+void sample_progress() {
+    long long searched;
+    {
+        lock_guard<mutex> lock(global_mutex);
+        searched = ledger.searched();
     }
-    // Assign new range
-    active_nodes[node_id] = range;
-    node_last_seen[node_id] = std::chrono::steady_clock::now();
-    Message assign(Message::ASSIGN, Message::Assign{node_id, checkpoint_interval, range, hashed_password, salt});
-    send_message(node_id, assign);
+    auto now = chrono::steady_clock::now();
+    progress_samples.emplace_back(now, searched);
+    while (now - progress_samples.front().first > chrono::seconds(ETA_WINDOW_SECONDS)) progress_samples.pop_front();
 }
 
-unordered_map<string, string> parse_flags(int argc, char *argv[]) {
+/**
+ * Seconds until a bounded keyspace is searched at the recent throughput, with a 95%
+ * interval from how much the throughput varied between steps of the window. The upper
+ * bound is infinite when the throughput might be zero.
+ * @return false until there are two steps of history.
+ */
+bool estimate_eta(long long remaining, double &eta, double &lower, double &upper) {
+    vector<double> rates;
+    for (size_t i = ETA_STEP_SECONDS; i < progress_samples.size(); i += ETA_STEP_SECONDS) {
+        const auto &[from_time, from] = progress_samples[i - ETA_STEP_SECONDS];
+        const auto &[to_time, to] = progress_samples[i];
+        double seconds = chrono::duration<double>(to_time - from_time).count();
+        if (seconds > 0) rates.push_back(static_cast<double>(to - from) / seconds);
+    }
+    if (rates.size() < 2) return false;
+    double mean = 0, variance = 0;
+    for (double rate : rates) mean += rate;
+    mean /= static_cast<double>(rates.size());
+    for (double rate : rates) variance += (rate - mean) * (rate - mean);
+    variance /= static_cast<double>(rates.size() - 1);
+    double margin = 1.96 * sqrt(variance / static_cast<double>(rates.size()));
+
+    auto time_at = [remaining](double rate) { return rate > 0 ? static_cast<double>(remaining) / rate : INFINITY; };
+    eta = remaining > 0 ? time_at(mean) : 0;
+    lower = remaining > 0 ? time_at(mean + margin) : 0;
+    upper = remaining > 0 ? time_at(mean - margin) : 0;
+    return true;
+}
+
+string render_metrics() {
+    struct NodeRate {
+        int session;
+        int fd;
+        double rate;
+    };
+    vector<NodeRate> node_rates;
+    double rate;
+    long long searched, leased, returned, keyspace_end;
+    double coverage;
+    size_t fragments, session_count;
+    bool bounded;
+    {
+        lock_guard<mutex> lock(global_mutex);
+        rate = cluster_rate;
+        searched = ledger.searched();
+        leased = ledger.leased();
+        returned = ledger.returned();
+        keyspace_end = ledger.keyspace_end();
+        bounded = ledger.bounded() && !relay_mode;
+        coverage = ledger.coverage();
+        fragments = ledger.fragments();
+        session_count = sessions.size();
+        for (const auto &[id, session] : sessions) {
+            if (session.fd >= 0) node_rates.push_back({id, session.fd, session.hash_rate});
+        }
+    }
+
+    string out;
+    out.reserve(4096 + node_rates.size() * 64);
+    Metrics::single(out, "crack_hash_rate", "gauge", "Hashes per second across the connected nodes.", rate);
+    Metrics::family(out, "crack_node_hash_rate", "gauge", "Hashes per second of one connected node, by session and socket.");
+    for (const auto &node : node_rates) {
+        Metrics::sample(out, "crack_node_hash_rate",
+                        "session=\"" + to_string(node.session) + "\",node=\"" + to_string(node.fd) + "\"", node.rate);
+    }
+    Metrics::single(out, "crack_nodes_connected", "gauge", "Connected nodes.", static_cast<double>(connected_nodes));
+    Metrics::single(out, "crack_sessions", "gauge", "Sessions, including disconnected ones in their grace period.",
+                    static_cast<double>(session_count));
+
+    if (bounded) {
+        Metrics::single(out, "crack_keyspace_candidates", "gauge", "Candidates in the bounded keyspace.",
+                        static_cast<double>(keyspace_end));
+    }
+    if (!relay_mode) {
+        // A relay's ledger marks everything below its first grant as searched, which it never was.
+        Metrics::single(out, "crack_searched_candidates", "gauge", "Candidates searched.", static_cast<double>(searched));
+        Metrics::single(out, "crack_coverage_ratio", "gauge", "Share of the keyspace searched; of the frontier when unbounded.",
+                        coverage);
+    }
+    Metrics::single(out, "crack_leased_candidates", "gauge", "Candidates leased to nodes and not yet reported.",
+                    static_cast<double>(leased));
+    Metrics::single(out, "crack_returned_candidates", "gauge", "Candidates handed back by nodes that went away, waiting to be leased again.",
+                    static_cast<double>(returned));
+    Metrics::single(out, "crack_ledger_fragments", "gauge", "Segments in the work ledger.", static_cast<double>(fragments));
+
+    Metrics::single(out, "crack_ranges_assigned_total", "counter", "Ranges sent to nodes in ASSIGNs.",
+                    static_cast<double>(ranges_assigned.load()));
+    Metrics::single(out, "crack_assigned_candidates_total", "counter", "Candidates sent to nodes in ASSIGNs.",
+                    static_cast<double>(candidates_assigned.load()));
+    Metrics::single(out, "crack_reassigned_candidates_total", "counter", "Candidates leased again after their holder went away.",
+                    static_cast<double>(candidates_reassigned.load()));
+    Metrics::single(out, "crack_duplicated_candidates_total", "counter", "Candidates given to a second node in the endgame.",
+                    static_cast<double>(candidates_duplicated.load()));
+    Metrics::single(out, "crack_overlapped_candidates_total", "counter", "Candidates of split leases searched by both nodes.",
+                    static_cast<double>(candidates_overlapped.load()));
+
+    Metrics::family(out, "crack_message_seconds", "histogram", "Time to apply a node's message to the job state, by type.");
+    for (int type = 0; type <= Message::SHRINK; ++type) {
+        if (message_latency[type].count() > 0)
+            message_latency[type].write(out, "crack_message_seconds", "type=\"" + messages_text[type] + "\"");
+    }
+
+    double eta, lower, upper;
+    if (bounded && estimate_eta(keyspace_end - searched, eta, lower, upper)) {
+        Metrics::single(out, "crack_eta_seconds", "gauge", "Seconds until the keyspace is searched at the last minute's rate.", eta);
+        Metrics::single(out, "crack_eta_lower_seconds", "gauge", "Lower end of the ETA's 95% interval.", lower);
+        Metrics::single(out, "crack_eta_upper_seconds", "gauge", "Upper end of the ETA's 95% interval.", upper);
+    }
+    Metrics::single(out, "crack_password_found", "gauge", "1 once a node has found the password.", password_found ? 1 : 0);
+    Metrics::single(out, "crack_log_dropped_lines_total", "counter", "Log lines lost to a full log ring.",
+                    static_cast<double>(Log::dropped()));
+    return out;
+}
+
+unordered_map<string, string> parse_flags(int argc, char *argv[], int first) {
     unordered_map<string, string> flags;
-    for (int i = 1; i < argc; i += 2) {
+    for (int i = first; i < argc; i += 2) {
         if (argv[i][0] == '-' && argv[i][1] == '-') {  // Check for --flag
             string flag = argv[i] + 2;  // Skip "--"
             flags[flag] = (i + 1 < argc) ? argv[i + 1] : "";
@@ -349,13 +1501,22 @@ unordered_map<string, string> parse_flags(int argc, char *argv[]) {
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 6) {
-        cerr << "Usage: " << argv[0] << " --port --hash --work-size --checkpoint_interval --timeout\n";
+    if (argc < 6) {
+        cerr << "Usage: " << argv[0] << " --port --hash --work-size --checkpoint_interval(seconds) --timeout"
+             << " [--unit-seconds N] [--max-length N] [--journal PATH] [--grace SECONDS] [--io-threads N]"
+             << " [--lease-window SECONDS] [--unix PATH] [--relay IP|unix:PATH --relay-port N]"
+             << " [--log-level debug|info|warn|error|off] [--log-format text|json] [--log-file PATH]"
+             << " [--metrics PORT|unix:PATH]\n";
         return 1;
     }
 
 
     signal(SIGPIPE, SIG_IGN);
+    rlimit files{};
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max; // One fd per node; the soft default of 1024 is far below a large fleet.
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
@@ -365,11 +1526,79 @@ int main(int argc, char *argv[]) {
     checkpoint_interval = stoi(argv[4]);
     int timeout = stoi(argv[5]);
 
+    auto flags = parse_flags(argc, argv, 6);
+    if (!Log::configure(flags["log-level"], flags["log-format"], flags["log-file"])) return 1;
+    if (flags.count("grace")) grace_seconds = max(0LL, stoll(flags["grace"]));
+    int io_threads = flags.count("io-threads") ? max(1, stoi(flags["io-threads"])) : 1;
+    if (flags.count("unix")) unix_path = flags["unix"];
+    if (flags.count("lease-window")) window_seconds = max(0LL, stoll(flags["lease-window"]));
+    if (flags.count("unit-seconds")) unit_seconds = max(0LL, stoll(flags["unit-seconds"]));
+    if (flags.count("relay")) {
+        if (flags.count("journal") || flags.count("max-length")) {
+            LOG(ERROR) << "--relay takes its keyspace and recovery from the parent; drop --journal and --max-length";
+            return 1;
+        }
+        parent = Transport::parse(flags["relay"], flags.count("relay-port") ? stoi(flags["relay-port"]) : port);
+        relay_mode = true;
+        ledger = WorkLedger(0); // Grows with every grant from the parent.
+    }
+    if (flags.count("max-length")) {
+        int length = clamp(stoi(flags["max-length"]), 1, MAX_BOUNDED_LENGTH);
+        long long keyspace_end = 1;
+        for (int i = 0; i < length; ++i) keyspace_end *= PRINTABLE_RANGE;
+        ledger = WorkLedger(keyspace_end);
+        LOG(INFO) << "Searching passwords up to " << length << " characters: " << keyspace_end << " candidates";
+    }
+
     extract_salt(hash, salt, sizeof(salt));
     strcpy(hashed_password, hash);
+    job = Message::Job{1, checkpoint_interval, hashed_password, salt};
     server_start_time = chrono::steady_clock::now();
 
-    start_server(port, work_size, timeout);
+    if (flags.count("journal")) {
+        journal = make_unique<Journal>(flags["journal"], string(hashed_password) + " " + to_string(ledger.keyspace_end()));
+        if (!journal->recover(ledger)) return 1;
+        if (ledger.frontier() > 0) {
+            LOG(INFO) << "Resumed job from " << flags["journal"] << ": " << ledger.searched() << " candidates searched ("
+                 << ledger.coverage() * 100 << "%), " << ledger.returned() << " to redo, frontier "
+                 << ledger.frontier();
+        }
+        journal->compact(ledger);
+    }
+
+    thread metrics;
+    string metrics_path;
+    if (flags.count("metrics")) {
+        const string &value = flags["metrics"];
+        auto where = Transport::parse(value, 0);
+        int metrics_fd;
+        if (where.kind == Transport::UNIX) {
+            metrics_path = where.address;
+            metrics_fd = Transport::listen_unix(metrics_path, 16);
+        } else {
+            bool numeric = !value.empty() && value.size() <= 5 && all_of(value.begin(), value.end(), ::isdigit);
+            int metrics_port = numeric ? stoi(value) : 0;
+            if (metrics_port < 1 || metrics_port > 65535 || metrics_port == port) {
+                LOG(ERROR) << "--metrics takes a port other than the nodes' or unix:PATH, not " << value;
+                return 1;
+            }
+            metrics_fd = Transport::listen_loopback(metrics_port, 16);
+        }
+        if (metrics_fd < 0) return 1;
+        LOG(INFO) << "Serving metrics on " << flags["metrics"];
+        metrics = thread([metrics_fd] {
+            Metrics::serve(metrics_fd, render_metrics, sample_progress, metrics_done);
+            close(metrics_fd);
+        });
+    }
+
+    start_server(port, work_size, timeout, io_threads);
+    if (metrics.joinable()) {
+        metrics_done = true;
+        metrics.join();
+        if (!metrics_path.empty()) unlink(metrics_path.c_str());
+    }
+    if (journal) journal->compact(ledger);
     return 0;
 }
 
@@ -4,166 +4,467 @@
 #include <arpa/inet.h>
 #include <atomic>
 #include "Message.h"
+#include "Topology.h"
+#include "AutoTune.h"
+#include "Transport.h"
+#include "Log.h"
 #include <thread>
 #include <crypt.h>
 #include <cstring>
 #include <algorithm>
+#include <cmath>
 #include <mutex>
 #include <unistd.h>
 #include <csignal>
+#include <deque>
+#include <memory>
+#include <condition_variable>
+#include <unordered_map>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 using namespace std;
-int worker_socket;
+atomic<int> worker_socket(-1);      // Replaced under send_mutex when the node reconnects.
+Transport::Endpoint server;          // TCP, or a Unix-domain socket when co-located with the controller.
 mutex mtx;
 
-vector<string> messages_text{"REQUEST", "ASSIGN", "CHECKPOINT", "FOUND", "STOP", "CONTINUE"};
+vector<string> messages_text{"REQUEST", "ASSIGN", "CHECKPOINT", "FOUND", "STOP", "CONTINUE", "HELLO", "HEARTBEAT", "JOB", "REVOKE", "SHRINK"};
 long long start_range, end_range;
 atomic<bool> password_found(false);
 
 long long pwd_idx;
 
-vector<pair<long long, long long>> thread_ranges;
 constexpr int PRINTABLE_RANGE = 57;
 constexpr int BASE_ASCII = 48;
+constexpr uint32_t MAX_FRAME_SIZE = 10 * 1024 * 1024; // As the controller's; a larger prefix is corrupt.
 
 atomic<bool> shutdown_requested(false);
 
-bool divide_work(int num_threads, const string &hashed_password, const string &salt, long long total_start,
-                 long long total_end);
+/**
+ * Set once the node must stop cracking (STOP received, password found, or a signal).
+ * Workers only read it, so it gets its own cache line instead of sharing one with
+ * flags and counters that are written during cracking.
+ */
+struct alignas(64) CancelFlag {
+    atomic<bool> stop{false};
+};
+CancelFlag cancel_work;
+
+/**
+ * Per-thread counters, one cache line per pool thread. Only the owning worker writes
+ * its slot; other threads may read it, so the hot loop never bounces a shared line.
+ */
+struct alignas(64) WorkerStats {
+    atomic<unsigned long long> tested{0};
+    atomic<unsigned long long> idle_ns{0}; // Time spent with nothing to claim while active.
+};
+vector<WorkerStats> worker_stats;
+
+// Control Channel
+int wake_fd = -1;                    // eventfd used to wake the I/O thread from workers and signal handlers.
+atomic<bool> request_pending(false); // A REQUEST is in flight and its ASSIGN hasn't arrived yet.
+bool controller_gone = false;        // STOP received or the connection dropped; nothing more can be sent.
+unsigned long long session_token = 0; // Issued by the controller in its HELLO, presented on reconnect.
+long long reconnect_timeout = 120;   // Seconds to keep retrying a lost controller before giving up.
+string placement;                    // Sent in every HELLO.
+deque<Message::MessageType> awaiting_reply; // REQUESTs and CHECKPOINTs sent, in order; each gets one reply.
+string recv_buffer; // Bytes from the controller not yet parsed into frames. I/O thread only.
+chrono::steady_clock::time_point next_request_at; // Backoff after the controller had no work to give.
+
+// Telemetry, owned by the I/O thread
+long long heartbeat_interval = 5;    // Seconds between HEARTBEATs. 0 disables.
+unsigned long long io_ns = 0;        // Time spent in socket sends and receives.
+vector<unsigned long long> heartbeat_tested; // Per-thread tested counts at the last heartbeat.
+
+// Work Pool
+/**
+ * A range handed out by the controller. Workers claim batches from `next` and add
+ * to `done` once a batch has been tested, so the unit is complete when done == size.
+ * A REVOKE can move `next` forward or `end` back; batches already claimed still count.
+ */
+struct WorkUnit {
+    long long start, end;
+    string hashed_password;
+    string salt;
+    long long next;           // Guarded by queue_mutex, as is end once the unit is queued.
+    long long done = 0;       // Guarded by queue_mutex.
+
+    WorkUnit(long long start, long long end, string hashed_password, string salt)
+            : start(start), end(end), hashed_password(std::move(hashed_password)),
+              salt(std::move(salt)), next(start) {}
+    [[nodiscard]] long long size() const { return end - start + 1; }
+};
+
+mutex queue_mutex, send_mutex;
+condition_variable work_cv;
+deque<shared_ptr<WorkUnit>> work_queue;        // Units with batches left to claim; front is being worked on.
+vector<shared_ptr<WorkUnit>> active_units;     // Assigned and not yet fully searched: the node's leases.
+vector<pair<long long, long long>> completed_units; // Finished since the last REQUEST.
+vector<pair<long long, long long>> searched_batches; // Batches finished since the last CHECKPOINT.
+atomic<long long> checkpoint_interval{0};          // Seconds between CHECKPOINTs, from the JOB. 0 disables.
+unordered_map<int, Message::Job> jobs;              // Descriptors the controller sent, by job id.
+
+// Tuning
+long long batch_size = 64;           // Candidates claimed by a worker at a time. Guarded by queue_mutex.
+int active_threads = 0;              // Pool threads allowed to claim batches. Guarded by queue_mutex.
+double prefetch_threshold = 0.75;    // Fraction of the front unit claimed before asking for the next one.
+size_t prefetch_depth = 1;           // Units kept queued behind the one being worked on.
+
+// Placement
+Topology topology;
+Topology::Pinning pinning = Topology::NONE;
+vector<int> cpu_order;               // CPUs pool threads are pinned to, empty when unpinned.
+
+// Calibration, only with --thread auto
+unique_ptr<AutoTune> tuner;
+string tuned_algorithm;              // Algorithm the current configuration was chosen for.
+struct TuneWindow {
+    chrono::steady_clock::time_point started;
+    unsigned long long tested_at_start = 0;
+    unsigned long long idle_at_start = 0;
+    bool measuring = false;          // False while threads settle after a configuration change.
+} tune_window;
+
+void tune_for(const string &salt);
+vector<pair<long long, long long>> revoke_ranges(const vector<pair<long long, long long>> &ranges);
+
+/**
+ * Wakes the I/O thread. Only uses write(2), so it is safe from signal handlers.
+ */
+void wake_io() {
+    uint64_t one = 1;
+    if (wake_fd >= 0) (void) !write(wake_fd, &one, sizeof(one));
+}
+
+/**
+ * Tells every worker to abandon its batch and wakes the I/O thread.
+ */
+void cancel_all() {
+    cancel_work.stop.store(true, memory_order_release);
+    wake_io();
+}
 
 void signal_handler(int signum) {
-    cout << "\nSignal (" << signum << ") received. Shutting down..." << endl;
+    LOG(INFO) << "Signal (" << signum << ") received. Shutting down...";
     shutdown_requested.store(true);
+    cancel_all();
 }
 
-bool recv_message(int client_socket, Message &msg) {
-    uint32_t net_size;
-    ssize_t recvd = recv(client_socket, &net_size, sizeof(net_size), MSG_WAITALL);
+/**
+ * Reads whatever the controller has sent with one recv and appends every complete
+ * frame in it to msgs. A partial frame stays in recv_buffer for the next call.
+ * @return false if the connection closed or sent something unparseable.
+ */
+bool recv_messages(int client_socket, vector<Message> &msgs) {
+    char chunk[16 * 1024];
+    ssize_t recvd = recv(client_socket, chunk, sizeof(chunk), 0);
     if (recvd <= 0) {
-        cerr << "Failed to receive message size or client disconnected.\n";
+        LOG(WARN) << "Failed to receive from controller or it disconnected.";
         return false;
     }
-    uint32_t size = ntohl(net_size);
-    string buffer(size, '\0');
-    size_t total_received = 0;
-    while (total_received < size) {
-        ssize_t r = recv(client_socket, buffer.data() + total_received, size - total_received, 0);
-        if (r <= 0) {
-            cerr << "Failed to receive full message.\n";
+    recv_buffer.append(chunk, recvd);
+
+    size_t parsed = 0;
+    while (recv_buffer.size() - parsed >= sizeof(uint32_t)) {
+        uint32_t net_size;
+        memcpy(&net_size, recv_buffer.data() + parsed, sizeof(net_size));
+        uint32_t size = ntohl(net_size);
+        if (size == 0 || size > MAX_FRAME_SIZE) {
+            LOG(WARN) << "Invalid message size from controller: " << size;
             return false;
         }
-        total_received += r;
-    }
-    try {
-        msg = Message::deserialize(buffer);
-    } catch (const exception &e) {
-        cerr << "Deserialization failed: " << e.what() << "\n";
-        return false;
+        if (recv_buffer.size() - parsed - sizeof(net_size) < size) break;
+        try {
+            msgs.push_back(Message::deserialize(string_view(recv_buffer).substr(parsed + sizeof(net_size), size)));
+        } catch (const exception &e) {
+            LOG(WARN) << "Deserialization failed: " << e.what();
+            return false;
+        }
+        parsed += sizeof(net_size) + size;
     }
+    recv_buffer.erase(0, parsed);
     return true;
 }
 
 void send_message(int client_socket, const Message &msg) {
-    string serialized = msg.serialize();
-    uint32_t size = htonl(static_cast<uint32_t>(serialized.size()));
-    if (send(client_socket, &size, sizeof(size), 0) != sizeof(size)) {
-        cerr << "Failed to send message size.\n";
-        return;
-    }
-    const char *data = serialized.c_str();
+    string frame;
+    msg.append_frame(frame); // Header and body in one buffer, so one send per message.
+    lock_guard<mutex> lock(send_mutex); // Workers send FOUND while the main thread sends REQUESTs.
     size_t total_sent = 0;
-    size_t total_size = serialized.size();
-    while (total_sent < total_size) {
-        ssize_t sent = send(client_socket, data + total_sent, total_size - total_sent, 0);
+    while (total_sent < frame.size()) {
+        ssize_t sent = send(client_socket, frame.data() + total_sent, frame.size() - total_sent, MSG_NOSIGNAL);
         if (sent <= 0) {
-            cerr << "Failed to send full message.\n";
+            LOG(WARN) << "Failed to send full message.";
             return;
         }
         total_sent += sent;
     }
 }
 
-void start_conn(const string &server_ip, int server_port) {
-    int sock;
-    bool ipv6;
-    if (server_ip.find(':') != string::npos) {
-        sock = socket(AF_INET6, SOCK_STREAM, 0);
-        ipv6 = true;
-    } else {
-        sock = socket(AF_INET, SOCK_STREAM, 0);
-        ipv6 = false;
-    }
-    if (sock == -1) {
-        perror("Socket Failed!");
-        exit(1);
-    }
-    if (ipv6) {
-        struct sockaddr_in6 server_addr{};
-        server_addr.sin6_family = AF_INET6;
-        server_addr.sin6_port = htons(server_port);
-        if (inet_pton(AF_INET6, server_ip.c_str(), &server_addr.sin6_addr) <= 0) {
-            cerr << "Invalid IPv6 address format. \n";
-            close(sock);
-            return;
-        }
-        if (connect(sock, (struct sockaddr *) &server_addr, sizeof(server_addr)) <= 0) {
-            cerr << "IPv6 connection failed with " << server_ip << " on port: " << server_port << endl;
-            close(sock);
-            return;
-        }
-    } else {
-        struct sockaddr_in server_addr4{};
-        server_addr4.sin_family = AF_INET;
-        server_addr4.sin_port = htons(server_port);
-        if (inet_pton(AF_INET, server_ip.c_str(), &server_addr4.sin_addr) <= 0) {
-            cerr << "Invalid IPv4 address format. \n";
-            close(sock);
-            return;
-        }
-        if (connect(sock, (struct sockaddr *) &server_addr4, sizeof(server_addr4)) < 0) {
-            cerr << "IPv4 connection failed with " << server_ip << " on port: " << server_port << endl;
-            close(sock);
-            return;
-        }
-    }
-    cout << "Connected to server: " << server_ip << " on port: " << server_port << endl;
+/**
+ * Connects to the controller and makes it the node's socket.
+ * @return false if the connection could not be made.
+ */
+bool start_conn() {
+    int sock = Transport::connect_to(server);
+    if (sock < 0) return false;
+    LOG(INFO) << "Connected to server: " << Transport::describe(server);
+    lock_guard<mutex> lock(send_mutex);
     worker_socket = sock;
+    return true;
 }
 
-bool request_work(int num_threads, string &hashed_password, string &salt) {
-    cout << "Requesting Work from Controller" << endl;
+/**
+ * Sends a REQUEST carrying the units completed so far. The ASSIGN is picked up by the
+ * I/O loop, so workers keep cracking the queued units in the meantime.
+ */
+void send_request() {
+    vector<pair<long long, long long>> done;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        done.swap(completed_units);
+    }
+    LOG(DEBUG) << "Requesting Work from Controller";
     Message request_msg(Message::REQUEST);
+    if (!done.empty()) request_msg.Checkpoint_Data = Message::Checkpoint{worker_socket, done};
+    request_pending.store(true);
+    awaiting_reply.push_back(Message::REQUEST);
     send_message(worker_socket, request_msg);
-    Message resp;
-    bool received = recv_message(worker_socket, resp);
-    cout << messages_text[resp.type] << endl;
-
-    if (received && resp.type == Message::ASSIGN && resp.Assign_Data) {
-        start_range = resp.Assign_Data->range.first;
-        end_range = resp.Assign_Data->range.second;
-        hashed_password = resp.Assign_Data->hashed_password;
-        salt = resp.Assign_Data->salt;
-        cout << "Range received: " << start_range << "-" << end_range << endl;
-        divide_work(num_threads, hashed_password, salt, start_range, end_range);
-        return true;
-    } else if (received && resp.type == Message::STOP) {
-        cout << "[!] Received STOP from server. Exiting..." << endl;
-        shutdown_requested.store(true);
-        return false;
+}
+
+/**
+ * Reports the batches searched since the last checkpoint, so the controller only
+ * reassigns what is actually unfinished. Serialization merges them into contiguous
+ * ranges and picks the most compact encoding.
+ */
+void send_checkpoint() {
+    vector<pair<long long, long long>> batches;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        batches.swap(searched_batches);
+    }
+    if (batches.empty()) return;
+    awaiting_reply.push_back(Message::CHECKPOINT);
+    send_message(worker_socket, Message{Message::CHECKPOINT, Message::Checkpoint{worker_socket, batches}});
+}
+
+/**
+ * Introduces the node to the controller. After a reconnect it presents the session
+ * token and every unit still being worked on, so the controller keeps those leases.
+ */
+void send_hello(int num_threads) {
+    Message::Hello hello{worker_socket, num_threads, session_token, {}, placement};
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        for (const auto &unit : active_units) hello.leases.emplace_back(unit->start, unit->end);
+    }
+    send_message(worker_socket, Message{Message::HELLO, hello});
+}
+
+/**
+ * Re-establishes a lost controller connection with exponential backoff while the
+ * workers keep cracking. Replies to anything sent on the old connection are gone,
+ * so outstanding requests are forgotten and a FOUND is sent again.
+ * @return false if the controller stayed unreachable for reconnect_timeout seconds.
+ */
+bool reconnect(int num_threads) {
+    {
+        lock_guard<mutex> lock(send_mutex);
+        close(worker_socket);
+        worker_socket = -1;
+    }
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(reconnect_timeout);
+    auto backoff = chrono::milliseconds(100);
+    while (!shutdown_requested.load() && chrono::steady_clock::now() < deadline) {
+        LOG(WARN) << "Lost the controller, reconnecting in " << backoff.count() << "ms";
+        for (auto waited = chrono::milliseconds(0); waited < backoff && !shutdown_requested.load();
+             waited += chrono::milliseconds(50)) {
+            this_thread::sleep_for(chrono::milliseconds(50));
+        }
+        if (start_conn()) {
+            recv_buffer.clear();
+            awaiting_reply.clear();
+            request_pending.store(false);
+            next_request_at = {};
+            send_hello(num_threads);
+            if (password_found.load()) {
+                send_message(worker_socket, Message{Message::FOUND, Message::Found{worker_socket, pwd_idx}});
+            }
+            return true;
+        }
+        backoff = min(backoff * 2, chrono::milliseconds(5000));
     }
     return false;
 }
 
-void crack_password(int thread_id, long long start, long long end,
-                    const string &hashed_password, const string &salt) {
-    thread_local struct crypt_data crypt_buffer{};
+/**
+ * Handles one message read by the I/O thread.
+ * @return false once the node should stop.
+ */
+bool handle_message(const Message &msg) {
+    LOG(DEBUG) << messages_text[msg.type];
+    Message::MessageType replied_to = Message::CHECKPOINT;
+    if ((msg.type == Message::ASSIGN || msg.type == Message::CONTINUE) && !awaiting_reply.empty()) {
+        replied_to = awaiting_reply.front();
+        awaiting_reply.pop_front();
+    }
+    switch (msg.type) {
+        case Message::ASSIGN:
+            if (!msg.Assign_Data) break;
+            if (!jobs.count(msg.Assign_Data->job_id)) {
+                LOG(WARN) << "ASSIGN for unknown job " << msg.Assign_Data->job_id << ", ignoring it";
+                request_pending.store(false);
+                break;
+            }
+            {
+                const Message::Job &job = jobs[msg.Assign_Data->job_id];
+                lock_guard<mutex> lock(queue_mutex);
+                for (const auto &[start, end] : msg.Assign_Data->ranges) {
+                    start_range = start;
+                    end_range = end;
+                    LOG(DEBUG) << "Range received: " << start_range << "-" << end_range;
+                    auto unit = make_shared<WorkUnit>(start_range, end_range, job.hashed_password, job.salt);
+                    work_queue.push_back(unit);
+                    active_units.push_back(unit);
+                }
+            }
+            request_pending.store(false);
+            work_cv.notify_all();
+            break;
+        case Message::STOP:
+            if (password_found.load()) {
+                LOG(INFO) << "[✓] Received STOP from server. Shutting down...";
+            } else {
+                LOG(INFO) << "[!] Received STOP from server. Exiting...";
+            }
+            controller_gone = true;
+            shutdown_requested.store(true);
+            cancel_all();
+            return false;
+        case Message::HELLO:
+            if (msg.Hello_Data) {
+                session_token = msg.Hello_Data->session;
+                LOG(INFO) << "Session " << session_token << ", controller holds " << msg.Hello_Data->leases.size()
+                     << " of our leases";
+            }
+            break;
+        case Message::JOB:
+            if (msg.Job_Data) {
+                jobs[msg.Job_Data->job_id] = *msg.Job_Data;
+                checkpoint_interval = msg.Job_Data->checkpoint;
+                tune_for(msg.Job_Data->salt);
+            }
+            break;
+        case Message::REVOKE:
+            if (msg.Checkpoint_Data) revoke_ranges(msg.Checkpoint_Data->ranges);
+            break;
+        case Message::SHRINK:
+            // The acknowledgement tells the controller which part of the tail is really free of us.
+            if (msg.Checkpoint_Data) {
+                auto dropped = revoke_ranges(msg.Checkpoint_Data->ranges);
+                send_message(worker_socket, Message{Message::SHRINK, Message::Checkpoint{worker_socket, dropped}});
+            }
+            break;
+        case Message::CONTINUE:
+            // A CONTINUE answering a REQUEST means the controller has nothing to hand out right now.
+            if (replied_to == Message::REQUEST) {
+                request_pending.store(false);
+                next_request_at = chrono::steady_clock::now() + chrono::seconds(1);
+            }
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+/**
+ * Reports a fully searched unit with the next REQUEST. Called with queue_mutex held.
+ */
+void finish_unit(const shared_ptr<WorkUnit> &unit) {
+    if (unit->size() > 0) completed_units.emplace_back(unit->start, unit->end);
+    active_units.erase(find(active_units.begin(), active_units.end(), unit));
+    if (work_queue.empty()) wake_io();
+}
+
+/**
+ * Drops ranges the controller took back. Only unclaimed candidates can go: a revoked
+ * tail pulls `end` in and a revoked front skips `next` ahead, while batches workers
+ * already claimed finish normally. A hole in the middle of a unit is left alone.
+ * @return The parts actually dropped.
+ */
+vector<pair<long long, long long>> revoke_ranges(const vector<pair<long long, long long>> &ranges) {
+    vector<pair<long long, long long>> dropped;
+    lock_guard<mutex> lock(queue_mutex);
+    for (const auto &[start, end] : ranges) {
+        for (const auto &unit : vector<shared_ptr<WorkUnit>>(active_units)) {
+            if (end < unit->next || start > unit->end) continue;
+            long long from = max(start, unit->next), to = min(end, unit->end);
+            if (end >= unit->end) {
+                unit->end = from - 1; // Reported complete later as only what was searched here.
+            } else if (start <= unit->next) {
+                unit->next = to + 1;
+                unit->done += to - from + 1; // Searched elsewhere, so it counts toward the unit.
+            } else {
+                continue;
+            }
+            dropped.emplace_back(from, to);
+            LOG(DEBUG) << "Dropped " << from << "-" << to << ", unit now " << unit->start << "-" << unit->end;
+            if (unit->next > unit->end) {
+                auto queued = find(work_queue.begin(), work_queue.end(), unit);
+                if (queued != work_queue.end()) work_queue.erase(queued);
+            }
+            if (unit->done == unit->size()) finish_unit(unit);
+        }
+    }
+    return dropped;
+}
+
+/**
+ * Whether the node should ask for another unit. Called with queue_mutex held.
+ * True when nothing is queued, or when the front unit is past the prefetch threshold
+ * and fewer than prefetch_depth units are waiting behind it.
+ */
+bool needs_work() {
+    if (work_queue.empty()) return true;
+    if (work_queue.size() > prefetch_depth) return false;
+    const auto &front = work_queue.front();
+    double claimed = static_cast<double>(front->next - front->start) / static_cast<double>(front->size());
+    return claimed >= prefetch_threshold;
+}
+
+/**
+ * How many candidates to test between polls of the cancellation flag. Cheap formats
+ * poll less often; slow ones poll every candidate so STOP still lands in milliseconds.
+ */
+long long cancel_poll_interval(const string &hashed_password) {
+    if (hashed_password.rfind("$1$", 0) == 0) return 64;
+    if (hashed_password.rfind("$5$", 0) == 0 || hashed_password.rfind("$6$", 0) == 0) return 8;
+    return 1;
+}
+
+/**
+ * Tests candidates start..end against the hash.
+ * @return Number of candidates tested before finishing or being cancelled.
+ */
+long long crack_password(int thread_id, long long start, long long end,
+                         const string &hashed_password, const string &salt, crypt_data &crypt_buffer) {
     crypt_buffer.initialized = 0;
     char pwd_guess[256];
     size_t target_hash_len = hashed_password.length();
     const char *hashed_pwd = hashed_password.c_str();
     const char *pwd_salt = salt.c_str();
-    for (long long i = start; i <= end; ++i) {
-        if (password_found.load() || shutdown_requested.load()) break;
+    const long long poll_interval = cancel_poll_interval(hashed_password);
+    auto &stats = worker_stats[thread_id];
+    const unsigned long long tested_before = stats.tested.load(memory_order_relaxed);
+    long long until_poll = 0;
+    long long i = start;
+    for (; i <= end; ++i) {
+        if (--until_poll <= 0) {
+            if (cancel_work.stop.load(memory_order_relaxed)) break;
+            stats.tested.store(tested_before + (i - start), memory_order_relaxed);
+            until_poll = poll_interval;
+        }
         long long idx = i;
         size_t len = 0;
         while (idx || len == 0) {
@@ -173,7 +474,7 @@ void crack_password(int thread_id, long long start, long long end,
         pwd_guess[len] = '\0';
         const char *gen_hash = crypt_r(pwd_guess, pwd_salt, &crypt_buffer);
         if (!gen_hash) {
-            cerr << "Error: crypt_r() failed for password: " << pwd_guess << endl;
+            LOG(ERROR) << "crypt_r() failed for password: " << pwd_guess;
             continue;
         }
         size_t gen_hash_len = strlen(gen_hash);
@@ -182,92 +483,353 @@ void crack_password(int thread_id, long long start, long long end,
 
             lock_guard<mutex> lock(mtx);
             if (!password_found.exchange(true)) {
-                cout << "[+] Password found by thread " << thread_id << ": " << pwd_guess << endl;
+                LOG(INFO) << "[+] Password found by thread " << thread_id << ": " << pwd_guess;
                 pwd_idx = i;
 
                 // Send FOUND message to server
                 Message found_msg(Message::FOUND);
                 found_msg.Found_Data = Message::Found{worker_socket, pwd_idx};
                 send_message(worker_socket, found_msg);
+                cancel_all();
             }
-            return;
+            stats.tested.store(tested_before + (i - start + 1), memory_order_relaxed);
+            return i - start + 1;
         }
     }
+    stats.tested.store(tested_before + (i - start), memory_order_relaxed);
+    return i - start;
 }
 
 
-bool divide_work(int num_threads, const string &hashed_password, const string &salt,
-                 long long total_start, long long total_end) {
-    cout << "Dividing work across " << num_threads << " threads." << endl;
-    thread_ranges.resize(num_threads);
-    long long range_size = (total_end - total_start + 1) / num_threads;
-    vector<thread> threads;
-    threads.reserve(num_threads);
-    for (int i = 0; i < num_threads; ++i) {
-        long long start = total_start + i * range_size;
-        long long end = (i == num_threads - 1) ? total_end : start + range_size - 1;
-        thread_ranges[i] = {start, end};
-        threads.emplace_back(crack_password, i, start, end, hashed_password, salt);
-        cout << "Thread: " << i + 1 << ",Range: " << thread_ranges[i].first << "-" << thread_ranges[i].second << endl;
+/**
+ * Pool thread: claims batches from the front unit until the node is told to stop.
+ * Claiming the last batch of a unit pops it so the next queued unit starts immediately.
+ */
+void worker_loop(int thread_id) {
+    if (!cpu_order.empty()) {
+        int cpu = cpu_order[thread_id % cpu_order.size()];
+        if (!Topology::pin_current_thread(cpu)) LOG(WARN) << "Failed to pin thread " << thread_id << " to CPU " << cpu;
     }
-    for (auto &t: threads) {
-        if (t.joinable()) t.join();
+    // Allocated after pinning so first touch places the hashing state on this thread's NUMA node.
+    auto crypt_buffer = make_unique<crypt_data>();
+
+    while (true) {
+        shared_ptr<WorkUnit> unit;
+        long long start, end;
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            bool starved = thread_id < active_threads && work_queue.empty();
+            auto wait_start = starved ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+            work_cv.wait(lock, [thread_id] {
+                return (thread_id < active_threads && !work_queue.empty()) || cancel_work.stop.load();
+            });
+            if (starved) {
+                auto waited = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - wait_start);
+                auto &idle = worker_stats[thread_id].idle_ns;
+                idle.store(idle.load(memory_order_relaxed) + waited.count(), memory_order_relaxed);
+            }
+            if (cancel_work.stop.load()) return;
+            unit = work_queue.front();
+            start = unit->next;
+            end = min(start + batch_size - 1, unit->end);
+            unit->next = end + 1;
+            if (unit->next > unit->end) work_queue.pop_front();
+            if (!request_pending.load() && needs_work()) wake_io();
+        }
+        long long tested = crack_password(thread_id, start, end, unit->hashed_password, unit->salt, *crypt_buffer);
+        if (cancel_work.stop.load()) return;
+
+        lock_guard<mutex> lock(queue_mutex);
+        if (checkpoint_interval > 0) searched_batches.emplace_back(start, end); // Nobody collects them otherwise.
+        unit->done += tested;
+        if (unit->done == unit->size()) finish_unit(unit);
+    }
+}
+
+unsigned long long total_tested() {
+    unsigned long long total = 0;
+    for (const auto &stats : worker_stats) total += stats.tested.load(memory_order_relaxed);
+    return total;
+}
+
+unsigned long long total_idle_ns() {
+    unsigned long long total = 0;
+    for (const auto &stats : worker_stats) total += stats.idle_ns.load(memory_order_relaxed);
+    return total;
+}
+
+void apply_config(const AutoTune::Config &config) {
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        active_threads = config.threads;
+        batch_size = config.batch_size;
+    }
+    work_cv.notify_all();
+    tune_window = {chrono::steady_clock::now(), 0, 0, false};
+}
+
+/**
+ * Called for every ASSIGN when running with --thread auto. Uses the cached configuration
+ * for the unit's algorithm, or starts a calibration sweep that runs on the unit itself.
+ */
+void tune_for(const string &salt) {
+    string algorithm = AutoTune::algorithm_of(salt);
+    if (!tuner || algorithm == tuned_algorithm) return;
+    tuned_algorithm = algorithm;
+
+    if (auto cached = tuner->cached(algorithm)) {
+        LOG(INFO) << "Using tuned configuration for " << algorithm << ": " << cached->threads
+             << " threads, batch size " << cached->batch_size;
+        apply_config(*cached);
+        return;
+    }
+
+    int pool = static_cast<int>(worker_stats.size());
+    int physical = min(pool, max(1, topology.physical_cores()));
+    vector<int> thread_counts{max(1, physical / 2), physical, pool};
+    sort(thread_counts.begin(), thread_counts.end());
+    thread_counts.erase(unique(thread_counts.begin(), thread_counts.end()), thread_counts.end());
+    LOG(INFO) << "Calibrating for " << algorithm << "...";
+    tuner->begin(algorithm, thread_counts, {64, 16, 256});
+    apply_config(tuner->current());
+}
+
+/**
+ * Advances the calibration sweep from the I/O loop. A window skips the first 200ms
+ * after a change, then lasts at least one second and a few hashes per thread.
+ */
+void poll_tuning(chrono::steady_clock::time_point now) {
+    if (!tuner || !tuner->running()) return;
+    if (!tune_window.measuring) {
+        if (now - tune_window.started < chrono::milliseconds(200)) return;
+        tune_window = {now, total_tested(), total_idle_ns(), true};
+        return;
+    }
+    // A window in which workers waited for work measures the gap, not the configuration:
+    // start it over. A wait still in progress shows as an empty queue.
+    bool starved;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        starved = work_queue.empty();
+    }
+    unsigned long long idle = total_idle_ns();
+    if (starved || idle != tune_window.idle_at_start) {
+        tune_window = {now, total_tested(), idle, true};
+        return;
+    }
+    double elapsed = chrono::duration<double>(now - tune_window.started).count();
+    unsigned long long tested = total_tested() - tune_window.tested_at_start;
+    AutoTune::Config config = tuner->current();
+    if (elapsed < 1.0 || (tested < 4ULL * config.threads && elapsed < 10.0)) return;
+
+    double rate = static_cast<double>(tested) / elapsed;
+    LOG(INFO) << "Calibration: " << config.threads << " threads, batch size " << config.batch_size
+         << ": " << rate << " hashes/s";
+    if (tuner->record(rate)) {
+        apply_config(tuner->current());
+    } else {
+        AutoTune::Config best = tuner->best();
+        LOG(INFO) << "Calibrated " << tuned_algorithm << ": " << best.threads << " threads, batch size "
+             << best.batch_size;
+        apply_config(best);
+    }
+}
+
+/**
+ * Reports per-thread hash rates over the last interval, plus cumulative tested,
+ * idle and I/O time, so the controller can size work units and spot slow nodes.
+ */
+void send_heartbeat(double elapsed_seconds) {
+    Message::Telemetry telemetry{worker_socket, 0, 0, static_cast<long long>(io_ns / 1'000'000), {}};
+    heartbeat_tested.resize(worker_stats.size(), 0);
+    unsigned long long idle_ns = 0;
+    for (size_t t = 0; t < worker_stats.size(); ++t) {
+        unsigned long long tested = worker_stats[t].tested.load(memory_order_relaxed);
+        telemetry.thread_rates.push_back(static_cast<double>(tested - heartbeat_tested[t]) / elapsed_seconds);
+        telemetry.tested += static_cast<long long>(tested);
+        heartbeat_tested[t] = tested;
+        idle_ns += worker_stats[t].idle_ns.load(memory_order_relaxed);
+    }
+    telemetry.idle_ms = static_cast<long long>(idle_ns / 1'000'000);
+    send_message(worker_socket, Message{Message::HEARTBEAT, telemetry});
+}
+
+/**
+ * The node's I/O thread. Waits on the controller socket and the wake eventfd, so
+ * STOP is seen while workers are cracking and the next unit is requested as soon
+ * as the prefetch threshold is crossed.
+ */
+void run_io_loop(int num_threads) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        LOG(ERROR) << "epoll_create1 failed: " << strerror(errno);
+        return;
     }
-    return password_found.load();
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = worker_socket;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, worker_socket, &ev);
+    ev.data.fd = wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+    bool running = true;
+    epoll_event events[2];
+    auto last_checkpoint = chrono::steady_clock::now();
+    auto last_heartbeat = last_checkpoint;
+    auto io_timed = [](auto &&io) {
+        auto start = chrono::steady_clock::now();
+        io();
+        io_ns += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    };
+    while (running && !shutdown_requested.load()) {
+        int n = epoll_wait(epoll_fd, events, 2, 100);
+        for (int i = 0; i < n && running; ++i) {
+            if (events[i].data.fd == wake_fd) {
+                uint64_t count;
+                (void) !read(wake_fd, &count, sizeof(count));
+                continue;
+            }
+            vector<Message> msgs;
+            bool received;
+            io_timed([&] { received = recv_messages(worker_socket, msgs); });
+            if (!received) {
+                if (!shutdown_requested.load() && reconnect(num_threads)) {
+                    ev.data.fd = worker_socket;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, worker_socket, &ev);
+                    break;
+                }
+                controller_gone = true;
+                cancel_all();
+                running = false;
+                break;
+            }
+            for (const auto &msg : msgs) {
+                if (!(running = handle_message(msg))) break;
+            }
+        }
+        if (!running || password_found.load()) continue;
+
+        auto now = chrono::steady_clock::now();
+        poll_tuning(now);
+        if (checkpoint_interval > 0 && now - last_checkpoint >= chrono::seconds(checkpoint_interval)) {
+            io_timed(send_checkpoint);
+            last_checkpoint = now;
+        }
+        if (heartbeat_interval > 0 && now - last_heartbeat >= chrono::seconds(heartbeat_interval)) {
+            double elapsed = chrono::duration<double>(now - last_heartbeat).count();
+            io_timed([elapsed] { send_heartbeat(elapsed); });
+            last_heartbeat = now;
+        }
+        if (request_pending.load() || now < next_request_at) continue;
+
+        bool want_work;
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            want_work = needs_work();
+        }
+        if (want_work) io_timed(send_request);
+    }
+    close(epoll_fd);
+}
+
+unordered_map<string, string> parse_flags(int argc, char *argv[], int first) {
+    unordered_map<string, string> flags;
+    for (int i = first; i < argc; i += 2) {
+        if (argv[i][0] == '-' && argv[i][1] == '-') {  // Check for --flag
+            string flag = argv[i] + 2;  // Skip "--"
+            flags[flag] = (i + 1 < argc) ? argv[i + 1] : "";
+        }
+    }
+    return flags;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        cerr << "Usage: " << argv[0] << " --server --port --thread\n";
+    if (argc < 4) {
+        cerr << "Usage: " << argv[0] << " --server(IP|unix:PATH) --port --thread(N|auto)"
+             << " [--batch-size N] [--prefetch-threshold 0..1] [--prefetch-depth 1|2]"
+             << " [--pinning none|physical|socket|all] [--tune-cache PATH] [--heartbeat SECONDS]"
+             << " [--reconnect-timeout SECONDS] [--log-level debug|info|warn|error|off]"
+             << " [--log-format text|json] [--log-file PATH]\n";
         return 1;
     }
 
+    signal(SIGPIPE, SIG_IGN);
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
-    string server_ip = argv[1];
-    int server_port = stoi(argv[2]);
-    int num_threads = stoi(argv[3]);
+    server = Transport::parse(argv[1], stoi(argv[2]));
+    bool auto_threads = string(argv[3]) == "auto";
+    int num_threads = auto_threads ? 0 : stoi(argv[3]);
 
-    if (num_threads < 1) {
-        cerr << "Error: At least 1 thread needed to run.\n";
+    if (!auto_threads && num_threads < 1) {
+        LOG(ERROR) << "At least 1 thread needed to run.";
         return 1;
     }
 
-    cout << "Server IP: " << server_ip << endl;
-    cout << "Server Port: " << server_port << endl;
-    cout << "Number of Threads: " << num_threads << endl;
+    auto flags = parse_flags(argc, argv, 4);
+    if (!Log::configure(flags["log-level"], flags["log-format"], flags["log-file"])) return 1;
+    if (flags.count("batch-size")) batch_size = max(1LL, stoll(flags["batch-size"]));
+    if (flags.count("prefetch-threshold")) prefetch_threshold = clamp(stod(flags["prefetch-threshold"]), 0.0, 1.0);
+    if (flags.count("prefetch-depth")) prefetch_depth = clamp(stoul(flags["prefetch-depth"]), 1UL, 2UL);
+    if (flags.count("reconnect-timeout")) reconnect_timeout = max(0LL, stoll(flags["reconnect-timeout"]));
+    if (flags.count("heartbeat")) heartbeat_interval = max(0LL, stoll(flags["heartbeat"]));
+    if (flags.count("pinning") && !Topology::parse_pinning(flags["pinning"], pinning)) {
+        LOG(ERROR) << "Unknown pinning policy: " << flags["pinning"];
+        return 1;
+    }
 
-    string hashed_password, salt;
-    start_conn(server_ip, server_port);
+    topology = Topology::detect();
+    if (auto_threads) {
+        // The pool is sized for every usable CPU; calibration decides how many of them claim work.
+        double quota = Topology::cpu_quota();
+        num_threads = max(1, static_cast<int>(topology.cpus.size()));
+        if (quota > 0) num_threads = max(1, min(num_threads, static_cast<int>(ceil(quota))));
+        string cache_path = flags.count("tune-cache") ? flags["tune-cache"]
+                : string(getenv("HOME") ? getenv("HOME") : ".") + "/.comp8005_node_tune";
+        char host[256] = "localhost"; // The cache may sit in a $HOME shared by lab machines of the same size.
+        gethostname(host, sizeof(host) - 1);
+        string machine_key = string(host) + "-" + to_string(topology.cpus.size()) + "cpu-" + to_string(num_threads)
+                + "quota-" + Topology::pinning_name(pinning);
+        tuner = make_unique<AutoTune>(cache_path, machine_key);
+    }
+    active_threads = num_threads;
+    cpu_order = topology.placement(pinning);
+    placement = topology.describe(pinning, cpu_order, num_threads);
 
-    bool stop_received = false;
+    LOG(INFO) << "Server: " << Transport::describe(server);
+    LOG(INFO) << "Number of Threads: " << num_threads;
+    LOG(INFO) << "Placement: " << placement;
 
-    while (!stop_received) {
-        if (shutdown_requested.load()) {
-            stop_received = true;
-            continue;
-        }
-        if (password_found.load()) {
-            cout << "Password Found. Waiting for server to send STOP...\n";
-            Message maybe_stop;
-            if (recv_message(worker_socket, maybe_stop)) {
-                if (maybe_stop.type == Message::STOP) {
-                    cout << "[✓] Received STOP from server. Shutting down...\n";
-                    stop_received = true;
-                }
-            }
-            this_thread::sleep_for(chrono::milliseconds(100));
-            continue;
-        }
-        if (!request_work(num_threads, hashed_password, salt)) {
-            stop_received = true;
-            continue;
-        }
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        LOG(ERROR) << "eventfd failed: " << strerror(errno);
+        return 1;
+    }
+    if (!start_conn()) return 1;
+    send_hello(num_threads);
 
-        this_thread::sleep_for(chrono::milliseconds (500));
+    worker_stats = vector<WorkerStats>(num_threads);
+    vector<thread> workers;
+    workers.reserve(num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+        workers.emplace_back(worker_loop, i);
     }
 
+    run_io_loop(num_threads);
+
+    shutdown_requested.store(true);
+    cancel_all();
+    {
+        lock_guard<mutex> lock(queue_mutex); // Don't race a worker between its predicate check and wait.
+    }
+    work_cv.notify_all();
+    for (auto &t: workers) {
+        if (t.joinable()) t.join();
+    }
+    // Hand in whatever was searched before exiting so the controller doesn't reassign it.
+    if (!controller_gone && !password_found.load()) send_checkpoint();
+
     close(worker_socket);
+    close(wake_fd);
     return 0;
-}
\ No newline at end of file
+}